@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MIDI_IMPLEMENTATION
+#include "midi.h"
+
+// Checks of the midi.h parts that main does not exercise, `make check`
+
+int failed = 0;
+
+#define CHECK(cond) \
+  do \
+  { \
+    if (!(cond)) \
+    { \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failed = 1; \
+    } \
+  } while (0)
+
+// Number of three byte events on `trk`, the delta time of the first one
+// in `first`
+size_t count_events(midi_track_t *trk, uint32_t *first)
+{
+  size_t n = 0, p = 0;
+  while (p < trk->size)
+  {
+    uint32_t dt = 0;
+    do
+      dt = dt << 7 | (trk->data[p] & 0x7f);
+    while (trk->data[p++] & 0x80);
+    if (n++ == 0)
+      *first = dt;
+    p += 3;
+  }
+  return n;
+}
+
+// Add the curve through `points` after a delay of 10 ticks and check the
+// number of events and the ticks left over after the last one
+void check_curve(const midi_breakpoint_t *points, size_t npoints,
+                 int tolerance, size_t events, uint32_t rest)
+{
+  midi_track_t *trk = midi_track_create();
+  uint32_t r = 0, first = 0;
+
+  CHECK(trk != NULL);
+  if (trk == NULL)
+    return;
+  CHECK(midi_track_add_curve_breakpoints(trk, 10, 0, MIDI_CURVE_PITCH_WHEEL,
+                                         points, npoints, tolerance,
+                                         &r) == MIDI_OK);
+  CHECK(count_events(trk, &first) == events);
+  CHECK(first == 10);
+  CHECK(r == rest);
+  midi_track_destroy(trk);
+}
+
+int main(void)
+{
+  // Every tick of a steep ramp is a new value, the last one is sent at
+  // the last point
+  const midi_breakpoint_t ramp[] = { { 0, 0 }, { 100, 0x3fff } };
+  check_curve(ramp, 2, 0, 101, 0);
+
+  // A flat curve is one event, held until the last point
+  const midi_breakpoint_t flat[] = { { 0, 0x2000 }, { 100, 0x2000 } };
+  check_curve(flat, 2, 0, 1, 100);
+
+  // A single point is one event at its tick
+  const midi_breakpoint_t point[] = { { 0, 0x2000 } };
+  check_curve(point, 1, 0, 1, 0);
+
+  if (!failed)
+    fprintf(stderr, "all checks passed\n");
+  return failed;
+}
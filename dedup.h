@@ -0,0 +1,181 @@
+/*
+ * dedup.h - concurrent set of 64 bit hashes
+ *
+ * Fixed size open addressing table, filled with compare and swap so any
+ * number of threads can insert at once. Memory is bounded at creation;
+ * a hash that finds no free slot within DEDUP_MAX_PROBES is let through
+ * as new and counted as an overflow.
+ *
+ * Each hash can also remember the lowest index that claimed it, so that
+ * work done out of order keeps the same copy of a duplicate as work done
+ * in order would: dedup_claim as soon as the hash is known, dedup_owns
+ * once every lower index has claimed.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define DEDUP_ERROR -1
+#define DEDUP_OK     0
+
+/* At most 2^26 slots, 1 GiB with owners */
+#define DEDUP_MAX_SLOTS ((uint64_t) 1 << 26)
+#define DEDUP_MAX_PROBES 256
+
+typedef struct {
+    _Atomic uint64_t *slots;
+    _Atomic uint64_t *owners;   /* Lowest index + 1 per slot, 0 for none */
+    uint64_t mask;
+    atomic_ulong seen;
+    atomic_ulong duplicates;
+    atomic_ulong overflows;
+} dedup_t;
+
+int dedup_init(dedup_t * set, uint64_t expected);
+void dedup_free(dedup_t * set);
+int dedup_insert(dedup_t * set, uint64_t hash);
+int dedup_claim(dedup_t * set, uint64_t hash, uint64_t index);
+int dedup_owns(dedup_t * set, uint64_t hash, uint64_t index);
+
+#endif                          /* DEDUP_H */
+
+#ifdef DEDUP_IMPLEMENTATION
+#undef DEDUP_IMPLEMENTATION
+
+#include <stdlib.h>
+
+int dedup_init(dedup_t *set, uint64_t expected)
+{
+    uint64_t nslots = 1024;
+    while (nslots < 2 * expected && nslots < DEDUP_MAX_SLOTS) {
+        nslots *= 2;
+    }
+
+    set->slots = calloc(nslots, sizeof(*set->slots));
+    set->owners = calloc(nslots, sizeof(*set->owners));
+    if (set->slots == NULL || set->owners == NULL) {
+        dedup_free(set);
+        return DEDUP_ERROR;
+    }
+
+    set->mask = nslots - 1;
+    atomic_init(&set->seen, 0);
+    atomic_init(&set->duplicates, 0);
+    atomic_init(&set->overflows, 0);
+    return DEDUP_OK;
+}
+
+void dedup_free(dedup_t *set)
+{
+    free(set->slots);
+    free(set->owners);
+    set->slots = NULL;
+    set->owners = NULL;
+}
+
+static uint64_t _dedup_mix(uint64_t hash)
+{
+    /* The low bits pick the slot; 0 marks an empty slot */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash + !hash;
+}
+
+/*
+ * Find the slot of `hash`, storing it in a free one if `add`. Sets `*added`
+ * if this call stored it, returns -1 if it is neither there nor stored
+ */
+static int64_t _dedup_find(dedup_t *set, uint64_t hash, int add, int *added)
+{
+    *added = 0;
+    uint64_t slot = hash & set->mask;
+    for (uint64_t probe = 0; probe < DEDUP_MAX_PROBES; probe++) {
+        uint64_t cur = atomic_load_explicit(&set->slots[slot],
+                                            memory_order_relaxed);
+        if (cur == 0 && !add) {
+            return -1;
+        }
+        if (cur == 0 &&
+            atomic_compare_exchange_strong_explicit(&set->slots[slot], &cur,
+                                                    hash,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed)) {
+            *added = 1;
+            return slot;
+        }
+        if (cur == hash) {
+            return slot;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    return -1;
+}
+
+/* Returns 1 if `hash` was not in the set before, 0 if it is a duplicate */
+int dedup_insert(dedup_t *set, uint64_t hash)
+{
+    int added;
+    atomic_fetch_add_explicit(&set->seen, 1, memory_order_relaxed);
+
+    if (_dedup_find(set, _dedup_mix(hash), 1, &added) < 0) {
+        atomic_fetch_add_explicit(&set->overflows, 1, memory_order_relaxed);
+        return 1;
+    }
+    if (!added) {
+        atomic_fetch_add_explicit(&set->duplicates, 1, memory_order_relaxed);
+    }
+    return added;
+}
+
+/*
+ * Claim `hash` for `index`. Returns 0 if a lower index already claimed it,
+ * so `index` can never own it, else 1
+ */
+int dedup_claim(dedup_t *set, uint64_t hash, uint64_t index)
+{
+    int added;
+    atomic_fetch_add_explicit(&set->seen, 1, memory_order_relaxed);
+
+    int64_t slot = _dedup_find(set, _dedup_mix(hash), 1, &added);
+    if (slot < 0) {
+        atomic_fetch_add_explicit(&set->overflows, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    /* Lower the owner to `index` unless it is lower already */
+    uint64_t cur = atomic_load_explicit(&set->owners[slot],
+                                        memory_order_relaxed);
+    while (cur == 0 || index + 1 < cur) {
+        if (atomic_compare_exchange_weak_explicit(&set->owners[slot], &cur,
+                                                  index + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return cur == index + 1;
+}
+
+/*
+ * Returns 1 if `index` is the lowest index that claimed `hash`, or if the
+ * hash could not be stored; 0 counts a duplicate. Only final once every
+ * lower index has claimed
+ */
+int dedup_owns(dedup_t *set, uint64_t hash, uint64_t index)
+{
+    int added;
+    int64_t slot = _dedup_find(set, _dedup_mix(hash), 0, &added);
+    if (slot < 0 ||
+        atomic_load_explicit(&set->owners[slot], memory_order_relaxed) ==
+        index + 1) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&set->duplicates, 1, memory_order_relaxed);
+    return 0;
+}
+
+#endif                          /* DEDUP_IMPLEMENTATION */
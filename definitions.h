@@ -2,6 +2,7 @@
 #define DEFINITIONS_H
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
 #include <string.h>
@@ -9,8 +10,11 @@
 
 #define PANIC(msg) assert(0 && msg)
 #define ABS(x) ((x) < 0 ? -(x) : (x))
+// Random state of the calling thread, seed by assigning to it
+_Thread_local unsigned int rng_state;
+
 // Random int in range [min, max)
-#define RRANGE(min, max) ((min) + (rand() % ((max - min))))
+#define RRANGE(min, max) ((min) + (rand_r(&rng_state) % ((max - min))))
 
 typedef uint8_t PitchClass;
 
@@ -24,8 +28,18 @@ typedef enum {
   TAG_DIMINISHED,
   TAG_AUGMENTED,
   // ...  
+  TAG_COUNT,
 } HarmTag;
 
+// Root position intervals of each kind of chord
+const PitchClass tag_intervals[TAG_COUNT][3] = {
+  [TAG_MAJOR]      = { 0, 4, 7 },
+  [TAG_MINOR]      = { 0, 3, 7 },
+  [TAG_SUSPENDED]  = { 0, 5, 7 },
+  [TAG_DIMINISHED] = { 0, 3, 6 },
+  [TAG_AUGMENTED]  = { 0, 4, 8 },
+};
+
 // Pitchclasses
 #define PCLS_C  ((PitchClass) 0)
 #define PCLS_CS ((PitchClass) 1)
@@ -76,6 +90,7 @@ typedef struct {
   HarmTag tag;
   PitchClass chord[3];
   PitchClass real_chord[3];
+  int prev_tag;  // Tag of the chord before, -1 for the first one
   // int meta;
 } ChordState;
 
@@ -95,6 +110,64 @@ void chst_copy(ChordState *dst, ChordState *const src)
   memcpy(dst, src, sizeof (ChordState));
 }
 
+// Root position chord of kind `tag` on `root`
+void chst_init(ChordState *chst, PitchClass root, HarmTag tag)
+{
+  chst->tag = tag;
+  chst->prev_tag = -1;
+  for (size_t i = 0; i < 3; i++)
+    chst->real_chord[i] = (root + tag_intervals[tag][i]) % 12;
+  memcpy(chst->chord, chst->real_chord, sizeof (chst->chord));
+}
+
+// Parse a chord name like "C", "F#m", "Ebsus", "Bdim" or "Abaug",
+// returns 0 on success
+int chst_parse(ChordState *chst, const char *s)
+{
+  static const PitchClass letters[] = {
+    PCLS_A, PCLS_B, PCLS_C, PCLS_D, PCLS_E, PCLS_F, PCLS_G,
+  };
+  static const struct { const char *suffix; HarmTag tag; } kinds[] = {
+    { "",    TAG_MAJOR },
+    { "m",   TAG_MINOR },
+    { "sus", TAG_SUSPENDED },
+    { "dim", TAG_DIMINISHED },
+    { "aug", TAG_AUGMENTED },
+  };
+
+  if (*s < 'A' || *s > 'G')
+    return -1;
+  int root = letters[*s++ - 'A'];
+  if (*s == '#')
+    root++, s++;
+  else if (*s == 'b')
+    root--, s++;
+
+  for (size_t i = 0; i < sizeof (kinds) / sizeof (*kinds); i++)
+  {
+    if (strcmp(s, kinds[i].suffix) == 0)
+    {
+      chst_init(chst, PCLS_WRAP(root), kinds[i].tag);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Initial value for chst_hash
+#define CHST_HASH_INIT 0xcbf29ce484222325ULL
+
+// Fold the voiced chord, transposed down by `t`, into the rolling hash `h`
+static inline uint64_t chst_hash(uint64_t h, ChordState *const chst, PitchClass t)
+{
+  for (size_t i = 0; i < 3; i++)
+  {
+    h ^= PCLS_WRAP(chst->chord[i] - t);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
 // Permutations
 typedef enum {
   PERM_ABC,
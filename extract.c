@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MIDI_IMPLEMENTATION
+#include "midi.h"
+
+#define PACK_IMPLEMENTATION
+#include "pack.h"
+
+void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s -i INDEX PACK   write entry INDEX to stdout\n"
+          "       %s -s SEED PACK    write the entry for SEED to stdout\n"
+          "       %s -l PACK         list entries\n",
+          prog, prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int64_t index = -1;
+  int by_seed = 0, list = 0;
+  unsigned long long seed = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:s:l")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i': index = strtoll(optarg, NULL, 0); break;
+      case 's': seed = strtoull(optarg, NULL, 0); by_seed = 1; break;
+      case 'l': list = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || (index < 0 && !by_seed && !list))
+    usage(argv[0]);
+
+  const char *path = argv[optind];
+  pack_reader_t pack;
+  if (pack_reader_open(&pack, path))
+  {
+    fprintf(stderr, "%s: not a valid pack file\n", path);
+    return 1;
+  }
+
+  pack_entry_t entry;
+
+  if (list)
+  {
+    for (uint64_t i = 0; i < pack.count; i++)
+    {
+      if (pack_reader_entry(&pack, i, &entry))
+        break;
+      printf("%llu\t%llu\t%llu\t%llu\n",
+             (unsigned long long) i,
+             (unsigned long long) entry.seed,
+             (unsigned long long) entry.offset,
+             (unsigned long long) entry.length);
+    }
+    pack_reader_close(&pack);
+    return 0;
+  }
+
+  if (by_seed)
+  {
+    index = pack_reader_find(&pack, seed);
+    if (index < 0)
+    {
+      fprintf(stderr, "%s: no entry for seed %llu\n", path, seed);
+      pack_reader_close(&pack);
+      return 1;
+    }
+  }
+
+  if (pack_reader_entry(&pack, index, &entry))
+  {
+    fprintf(stderr, "%s: no entry %lld\n", path, (long long) index);
+    pack_reader_close(&pack);
+    return 1;
+  }
+
+  size_t n = fwrite(pack.data + entry.offset, 1, entry.length, stdout);
+  pack_reader_close(&pack);
+  return n < entry.length ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+// Latency histogram with log-linear buckets: exact below 16 ns, then 16
+// buckets per power of two, so percentiles are within 1/16 of the truth.
+// Safe to record into from any number of threads.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define LAT_SUB     16
+#define LAT_BUCKETS (61 * LAT_SUB)
+
+typedef struct {
+  atomic_ulong counts[LAT_BUCKETS];
+  atomic_ulong total;
+  atomic_ulong max;
+} LatencyHist;
+
+static inline uint64_t lat_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t lat_bucket(uint64_t ns)
+{
+  if (ns < LAT_SUB)
+    return ns;
+  int e = 63 - __builtin_clzll(ns);
+  return (e - 3) * LAT_SUB + ((ns >> (e - 4)) & (LAT_SUB - 1));
+}
+
+// Smallest value that falls in bucket `i`
+static inline uint64_t lat_bucket_floor(size_t i)
+{
+  if (i < LAT_SUB)
+    return i;
+  int e = i / LAT_SUB + 3;
+  return (uint64_t) (LAT_SUB + i % LAT_SUB) << (e - 4);
+}
+
+void lat_record(LatencyHist *h, uint64_t ns)
+{
+  atomic_fetch_add_explicit(&h->counts[lat_bucket(ns)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+
+  unsigned long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (ns > max &&
+         !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+    ;
+}
+
+// Latency in ns below which a fraction `p` of the samples lie
+uint64_t lat_percentile(LatencyHist *h, double p)
+{
+  unsigned long total = atomic_load(&h->total);
+  unsigned long rank = p * total;
+  unsigned long seen = 0;
+
+  for (size_t i = 0; i < LAT_BUCKETS; i++)
+  {
+    seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (seen > rank)
+      return lat_bucket_floor(i);
+  }
+  return atomic_load(&h->max);
+}
+
+void lat_report(LatencyHist *h, FILE *f)
+{
+  fprintf(f, "requests %lu p50 %.1f us p90 %.1f us p99 %.1f us "
+          "p99.9 %.1f us max %.1f us\n",
+          atomic_load(&h->total),
+          lat_percentile(h, 0.50) / 1e3,
+          lat_percentile(h, 0.90) / 1e3,
+          lat_percentile(h, 0.99) / 1e3,
+          lat_percentile(h, 0.999) / 1e3,
+          atomic_load(&h->max) / 1e3);
+}
+
+#endif
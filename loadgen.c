@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "latency.h"
+
+// Load test client for `main -S SOCKET`: every connection sends its
+// requests back to back and waits for each answer.
+
+const char *path;
+const char *start = "C";
+unsigned long requests = 1000;
+unsigned long length = 32;
+LatencyHist latency;
+atomic_ulong failures;
+
+void *client(void *arg)
+{
+  unsigned long id = (unsigned long) arg;
+
+  struct sockaddr_un addr = { 0 };
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof (addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof (addr)))
+  {
+    perror(path);
+    atomic_fetch_add(&failures, requests);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  FILE *in = fdopen(fd, "r");
+  char req[128];
+  char *line = NULL;
+  size_t cap = 0;
+  uint8_t *body = NULL;
+  size_t body_cap = 0;
+
+  for (unsigned long i = 0; i < requests; i++)
+  {
+    int n = snprintf(req, sizeof (req), "%lu %lu %s default\n",
+                     id * requests + i, length, start);
+
+    uint64_t t0 = lat_now();
+    size_t size;
+    if (write(fd, req, n) != n || getline(&line, &cap, in) <= 0 ||
+        sscanf(line, "OK %zu", &size) != 1)
+    {
+      atomic_fetch_add(&failures, requests - i);
+      break;
+    }
+
+    if (size > body_cap)
+    {
+      free(body);
+      body_cap = size;
+      body = malloc(body_cap);
+    }
+    if (body == NULL || fread(body, 1, size, in) != size)
+    {
+      atomic_fetch_add(&failures, requests - i);
+      break;
+    }
+    lat_record(&latency, lat_now() - t0);
+  }
+
+  free(line);
+  free(body);
+  fclose(in);
+  return NULL;
+}
+
+void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s -S SOCKET [-c CONNECTIONS] [-n REQUESTS] [-l LENGTH] "
+          "[-s START]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long conns = 4;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "S:c:n:l:s:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'S': path = optarg; break;
+      case 'c': conns = strtoul(optarg, NULL, 0); break;
+      case 'n': requests = strtoul(optarg, NULL, 0); break;
+      case 'l': length = strtoul(optarg, NULL, 0); break;
+      case 's': start = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (path == NULL || optind != argc || conns == 0)
+    usage(argv[0]);
+
+  pthread_t *threads = malloc(sizeof (*threads) * conns);
+  if (threads == NULL)
+    return 1;
+
+  uint64_t t0 = lat_now();
+  unsigned long started = 0;
+  while (started < conns && !pthread_create(&threads[started], NULL, client,
+                                            (void *) started))
+    started++;
+  for (unsigned long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double secs = (lat_now() - t0) / 1e9;
+  free(threads);
+
+  unsigned long done = atomic_load(&latency.total);
+  printf("%lu connections, %lu requests in %.3f s, %.0f req/s, "
+         "%lu failed\n", started, done, secs, done / secs,
+         atomic_load(&failures));
+  lat_report(&latency, stdout);
+  return atomic_load(&failures) ? 1 : 0;
+}
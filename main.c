@@ -1,9 +1,23 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "definitions.h"
+#include "rules.h"
+#include "model.h"
+#include "prof.h"
 
+#define MIDI_TRACK_GROW() PROF_COUNT(PROF_REALLOCS, 1)
 #define MIDI_IMPLEMENTATION
 #include "midi.h"
 
+#define PACK_IMPLEMENTATION
+#include "pack.h"
+
+#define DEDUP_IMPLEMENTATION
+#include "dedup.h"
+
 #define VEL    96
 #define DIV    2048
 #define LEN    (DIV << 1)
@@ -14,301 +28,550 @@ const uint8_t oct[3] = { 4, 5, 6 };
 
 #define PITCH(oct, cls) (12 * (oct) + (cls))
 
-void play_chord(ChordState *chd, midi_track_t *trk, midi_track_t *base, int len)
+// Chord by chord trace on stderr, off in batch mode
+int verbose = 1;
+
+#define LOG(...) do { if (verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#include "voicing.h"
+#include "server.h"
+#include "skeleton.h"
+
+void play_chord(Voicing *v, midi_track_t *trk, midi_track_t *base, int len)
 {
   midi_message_t msg;
 
-  msg = midi_message_note_on(0, PITCH(base_oct, chd->chord[0]), VEL);
+  msg = midi_message_note_on(0, v->bass, VEL);
   midi_track_add_midi_message(base, 0, msg);
     for (size_t i = 0; i < 3; i++)
   {
-    msg = midi_message_note_on(0, PITCH(oct[i], chd->chord[i]), VEL);
+    msg = midi_message_note_on(0, v->upper[i], VEL);
     midi_track_add_midi_message(trk, 0, msg);
   }
 
-  msg = midi_message_note_off(0, PITCH(base_oct, chd->chord[0]), VEL);
+  msg = midi_message_note_off(0, v->bass, VEL);
   midi_track_add_midi_message(base, len, msg);
     for (size_t i = 0; i < 3; i++)
   {
-    msg = midi_message_note_off(0, PITCH(oct[i], chd->chord[i]), VEL);
+    msg = midi_message_note_off(0, v->upper[i], VEL);
     midi_track_add_midi_message(trk, i ? 0 : len, msg);
   }
+
+  PROF_COUNT(PROF_EVENTS, 8);
 }
 
-void pick_next_chord(ChordState *current);
+// Hold voices that keep their pitch across chord changes instead of
+// releasing and striking them again
+int tie_notes = 0;
 
-int main(int argc, char *argv[])
+// Notes sounding on a track in tied mode
+typedef struct {
+  midi_track_t *trk;
+  size_t nvoices;
+  uint8_t keys[3];
+  int sounding;
+  uint32_t pending;  // Ticks since the last event on the track
+} HeldNotes;
+
+void hold_init(HeldNotes *h, midi_track_t *trk, size_t nvoices)
 {
-  (void) argc;
-  (void) argv;
+  h->trk = trk;
+  h->nvoices = nvoices;
+  h->sounding = 0;
+  h->pending = 0;
+}
 
-  srand(0);
+// Emit an event after the ticks owed since the last one
+static inline void hold_event(HeldNotes *h, midi_message_t msg)
+{
+  midi_track_add_midi_message(h->trk, h->pending, msg);
+  h->pending = 0;
+  PROF_COUNT(PROF_EVENTS, 1);
+}
 
-  // Create Midi context
-  int div = midi_division_ticks_per_quarter_note(DIV);
-  int fmt = MIDI_FORMAT_SIMULTANEOUS;
-  midi_t mid = midi_create(fmt, div);
+// Move the voices to `keys` for `len` ticks, voices that keep their key
+// are held over
+void hold_chord(HeldNotes *h, const uint8_t *keys, uint32_t len)
+{
+  for (size_t i = 0; i < h->nvoices; i++)
+    if (h->sounding && h->keys[i] != keys[i])
+      hold_event(h, midi_message_note_off(0, h->keys[i], VEL));
+
+  for (size_t i = 0; i < h->nvoices; i++)
+  {
+    if (!h->sounding || h->keys[i] != keys[i])
+    {
+      hold_event(h, midi_message_note_on(0, keys[i], VEL));
+      h->keys[i] = keys[i];
+    }
+  }
+
+  h->sounding = 1;
+  h->pending += len;
+}
+
+void hold_release(HeldNotes *h)
+{
+  for (size_t i = 0; h->sounding && i < h->nvoices; i++)
+    hold_event(h, midi_message_note_off(0, h->keys[i], VEL));
+  h->sounding = 0;
+}
+
+// Like play_chord, but only voices that change are released and struck;
+// the first event after a boundary carries every tick held since the last
+// event, as play_chord's `i ? 0 : len` does
+void play_chord_tied(Voicing *v, HeldNotes *trk, HeldNotes *base, int len)
+{
+  hold_chord(base, &v->bass, len);
+  hold_chord(trk, v->upper, len);
+}
+
+void pick_next_chord(ChordState *current, Model *const model);
+
+// Generate `n` chords from `start` for `seed` into `seq`, with transitions
+// weighted by `model` or uniform if it is NULL. Returns the hash of the
+// transposition-normalized chord sequence
+uint64_t generate(ChordState *seq, size_t n, ChordState *const start,
+                  Model *const model, unsigned int seed)
+{
+  PROF_BEGIN(PROF_GENERATE);
+  rng_state = seed;
+
+  ChordState curr;
+  chst_copy(&curr, start);
+
+  // Pick chords, hashed relative to the first one
+  uint64_t hash = CHST_HASH_INIT;
+  PitchClass t = curr.chord[0];
+  for (size_t i = 0; i < n; i++)
+  {
+    if (verbose) print_chordstate(&curr, stderr);
+    chst_copy(&seq[i], &curr);
+    hash = chst_hash(hash, &curr, t);
+    pick_next_chord(&curr, model);
+  }
+
+  PROF_END(PROF_GENERATE);
+  return hash;
+}
+
+// Encode the `n` voiced chords of `voicing` into two empty tracks
+int encode_tracks(midi_track_t *main_trk, midi_track_t *base_trk,
+                  Voicing *voicing, size_t n)
+{
+  PROF_BEGIN(PROF_ENCODE);
+  if (tie_notes)
+  {
+    HeldNotes held_main, held_base;
+    hold_init(&held_main, main_trk, 3);
+    hold_init(&held_base, base_trk, 1);
+    for (size_t i = 0; i < n; i++)
+      play_chord_tied(&voicing[i], &held_main, &held_base, LEN);
+    hold_release(&held_main);
+    hold_release(&held_base);
+  }
+  else
+  {
+    for (size_t i = 0; i < n; i++)
+      play_chord(&voicing[i], main_trk, base_trk, LEN);
+  }
 
+  int err = midi_track_add_end_of_track_event(main_trk, 0) ||
+            midi_track_add_end_of_track_event(base_trk, 0);
+
+  PROF_COUNT(PROF_EVENTS, 2);
+  PROF_COUNT(PROF_TRACKS, 2);
+  PROF_COUNT(PROF_PROGRESSIONS, 1);
+  PROF_COUNT(PROF_BYTES, main_trk->size + base_trk->size);
+  PROF_END(PROF_ENCODE);
+  return err ? MIDI_ERROR : MIDI_OK;
+}
+
+// Encode the `n` voiced chords of `voicing` as tracks of `mid`
+int encode(midi_t *mid, Voicing *voicing, size_t n)
+{
   // Create tracks
   midi_track_t *main_trk = midi_track_create();
   midi_track_t *base_trk = midi_track_create();
+  if (main_trk == NULL || base_trk == NULL ||
+      encode_tracks(main_trk, base_trk, voicing, n))
+  {
+    if (main_trk) midi_track_destroy(main_trk);
+    if (base_trk) midi_track_destroy(base_trk);
+    return MIDI_ERROR;
+  }
 
-  // Create C major chord
-  ChordState curr, prev;
-  curr.tag = TAG_MAJOR;
-  curr.chord[0] = PCLS_C;
-  curr.chord[1] = PCLS_E;
-  curr.chord[2] = PCLS_G;
-  copy(curr.real_chord, curr.chord);
-
-  // Build tracks
-  for (size_t i = 0; i < NCHRDS; i++)
+  if (midi_add_track(mid, main_trk))
   {
-    print_chordstate(&curr, stderr);
-    play_chord(&curr, main_trk, base_trk, LEN);
-    pick_next_chord(&curr);
-    chst_copy(&prev, &curr);
+    midi_track_destroy(main_trk);
+    midi_track_destroy(base_trk);
+    return MIDI_ERROR;
   }
+  if (midi_add_track(mid, base_trk))
+  {
+    midi_track_destroy(base_trk);
+    return MIDI_ERROR;
+  }
+  return MIDI_OK;
+}
+
+// Progressions finished ahead of the next one to append, at most
+#define BATCH_WINDOW 64
+
+// One encoded progression waiting for its turn in the pack
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t cap;
+  unsigned int seed;
+  uint64_t hash;
+  int skipped;  // A lower seed has the same progression, nothing encoded
+  int ready;
+} BatchSlot;
+
+// Shared state of the batch workers
+typedef struct {
+  pack_writer_t pack;
+  pthread_mutex_t lock;
+  pthread_cond_t turn;  // Signalled when `committed` moves
+  dedup_t dedup;
+  int use_dedup;
+  atomic_ulong next;
+  unsigned long committed;  // Progressions appended or skipped so far
+  BatchSlot slots[BATCH_WINDOW];  // Progression i waits in i % BATCH_WINDOW
+  unsigned long count;
+  unsigned int seed;
+  ChordState start;
+  Model *model;
+  Skeleton *skeleton;  // NULL when tied notes change the layout
+  int validate;
+  atomic_int err;
+} Batch;
+
+// Check a patched skeleton against encoding `voicing` through midi_write,
+// returns 0 if they match byte for byte
+int skeleton_check(uint8_t *const patched, size_t size, Voicing *voicing,
+                   unsigned int seed)
+{
+  int div = midi_division_ticks_per_quarter_note(DIV);
+  midi_t mid = midi_create(MIDI_FORMAT_SIMULTANEOUS, div);
+  uint8_t *buf = malloc(size + 1);
+  FILE *f = buf ? fmemopen(buf, size + 1, "wb") : NULL;
 
-  // Finish and output Midi
-  midi_track_add_end_of_track_event(main_trk, 0);
-  midi_track_add_end_of_track_event(base_trk, 0);
-  midi_add_track(&mid, main_trk);
-  midi_add_track(&mid, base_trk);
-  midi_write(&mid, stdout);
+  // The progression was counted when it was patched
+  PROF_SUSPEND();
+  int err = f == NULL || encode(&mid, voicing, NCHRDS) ||
+            midi_size(&mid) != size || midi_write(&mid, f) || fflush(f) ||
+            memcmp(buf, patched, size) != 0;
+  PROF_RESUME();
+  if (err)
+    fprintf(stderr, "skeleton: seed %u differs from midi_write\n", seed);
+
+  if (f)
+    fclose(f);
+  free(buf);
   midi_destroy(&mid);
+  return err;
 }
 
+// Append every ready progression that is next in seed order, so the
+// pack does not depend on which worker finishes first. Called with
+// `b->lock` held, returns 0 on success
+int batch_commit(Batch *b)
+{
+  BatchSlot *slot;
+  while ((slot = &b->slots[b->committed % BATCH_WINDOW])->ready)
+  {
+    slot->ready = 0;
+    // Every lower seed has claimed its hash by now, so this keeps the
+    // first of a set of duplicates as a single thread would. A skipped
+    // slot never owns its hash
+    if (!b->use_dedup || dedup_owns(&b->dedup, slot->hash, b->committed))
+    {
+      PROF_BEGIN(PROF_WRITE);
+      int err = pack_writer_append_bytes(&b->pack, slot->seed, slot->data,
+                                         slot->size);
+      PROF_END(PROF_WRITE);
+      if (err)
+        return -1;
+    }
+    b->committed++;
+  }
+  return 0;
+}
 
-void pick_next_chord(ChordState *curr)
+void *batch_worker(void *arg)
 {
-#define TRP(_0, _1, _2)\
-  next.real_chord[0] = PCLS_WRAP(curr->real_chord[0] + _0);\
-  next.real_chord[1] = PCLS_WRAP(curr->real_chord[1] + _1);\
-  next.real_chord[2] = PCLS_WRAP(curr->real_chord[2] + _2)
+  Batch *b = arg;
+  ChordState seq[NCHRDS];
+  Voicing voicing[NCHRDS];
+  uint8_t from[VOICE_SCRATCH(NCHRDS)];
 
-  ChordState next;
+  int div = midi_division_ticks_per_quarter_note(DIV);
+  int fmt = MIDI_FORMAT_SIMULTANEOUS;
 
-  fprintf(stderr, "tag: %d\n", curr->tag);
-  switch (curr->tag)
+  for (;;)
   {
-    case TAG_MAJOR:
-    {
-      int case_ = RRANGE(0, 10);
-      fprintf(stderr, "major, case %d\n", case_);
-      switch (case_)
-      {
-        case 0:
-          // Transpose major chord a whole step down
-          TRP(-2, -2, -2);
-          next.tag = TAG_MAJOR;
-          break;
-        case 1:
-          // Transpose major chord a whole step down, make minor
-          TRP(-2, -3, -2);
-          next.tag = TAG_MINOR;
-          break;
-        case 2:
-          // Transpose a minor third up
-          TRP(+3, +3, +3);
-          next.tag = TAG_MAJOR;
-          break;
-        case 3:
-          // Transpose a major third up, make minor
-          TRP(+4, +3, +4);
-          next.tag = TAG_MINOR;
-          break;
-        case 4:
-          // Transpose to dominant, suspended
-          TRP(-5, -4, -5);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 5:
-          // Transpose a whole step up, suspended
-          TRP(+2, +3, +2);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 6:
-          // Make suspended
-          TRP(+0, +1, +0);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 7:
-          // Make dominant without one
-          TRP(+4, +3, +3);
-          next.tag = TAG_DIMINISHED;
-          break;
-        case 8:
-          // To dominant with low nine
-          TRP(+5, +4, +4);
-          next.tag = TAG_DIMINISHED;
-          break;
-        case 9:
-          // Raise fifth
-          TRP(+0, +0, +1);
-          next.tag = TAG_AUGMENTED;
-          break;
-        default:
-          PANIC("case out of range");
-      }
+    unsigned long i = atomic_fetch_add(&b->next, 1);
+    if (i >= b->count)
       break;
-    }
-    case TAG_MINOR:
-    {
-      int case_ = RRANGE(0, 10);
-      fprintf(stderr, "minor, case %d\n", case_);
-      switch (case_)
-      {
-        case 0:
-          // Transpose minor chord a major third down
-          TRP(-4, -4, -4);
-          next.tag = TAG_MINOR;
-          break;
-        case 1:
-          // Transpose minor chord a fourth, make major
-          TRP(+5, +6, +5);
-          next.tag = TAG_MAJOR;
-          break;
-        case 2:
-          // Transpose a fourth down
-          TRP(-5, -5, -5);
-          next.tag = TAG_MINOR;
-          break;
-        case 3:
-          // Transpose a whole step down, make major
-          TRP(-2, -1, -2);
-          next.tag = TAG_MAJOR;
-          break;
-        case 4:
-          // Transpose to dominant, suspended
-          TRP(-5, -3, -5);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 5:
-          // Transpose to subdominant, suspended
-          TRP(+5, +7, +5);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 6:
-          // Make suspended
-          TRP(+0, +2, +0);
-          next.tag = TAG_SUSPENDED;
-          break;
-        case 7:
-          // Lower fifth
-          TRP(+0, +0, -1);
-          next.tag = TAG_DIMINISHED;
-          break;
-        case 8:
-          // Add high sixth
-          TRP(-3, -3, -4);
-          next.tag = TAG_DIMINISHED;
-          break;
-        case 9:
-          // Lower base
-          TRP(-1, +0, +0);
-          next.tag = TAG_AUGMENTED;
-          break;
-        default:
-          PANIC("case out of range");
-      }
+
+    unsigned int seed = b->seed + i;
+    uint64_t hash = generate(seq, NCHRDS, &b->start, b->model, seed);
+
+    // Skip progressions a lower seed has before encoding anything
+    int skipped = b->use_dedup && !dedup_claim(&b->dedup, hash, i);
+    if (!skipped)
+      voice(voicing, seq, NCHRDS, from);
+
+    // Wait for the slot to be appended by the one BATCH_WINDOW before
+    BatchSlot *slot = &b->slots[i % BATCH_WINDOW];
+    pthread_mutex_lock(&b->lock);
+    while (i >= b->committed + BATCH_WINDOW && !atomic_load(&b->err))
+      pthread_cond_wait(&b->turn, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    if (atomic_load(&b->err))
       break;
-    }
-    case TAG_SUSPENDED:
+
+    int err = 0;
+    size_t size = 0;
+    if (!skipped && b->skeleton)
     {
-      int case_ = RRANGE(0, 4);
-      fprintf(stderr, "suspended, case %d\n", case_);
-      switch (case_)
+      size = b->skeleton->size;
+      err = worker_reserve((void **) &slot->data, &slot->cap, size, 1);
+      if (!err)
       {
-        case 0:
-          // Release, fourth goes to major third
-          TRP(+0, -1, +0);
-          next.tag = TAG_MAJOR;
-          break;
-        case 1:
-          // Release, fourth goes to minor third
-          TRP(+0, -2, +0);
-          next.tag = TAG_MINOR;
-          break;
-        case 2:
-          // Release, fifth goes to major third
-          TRP(+5, +4, +5);
-          next.tag = TAG_MAJOR;
-          break;
-        case 3:
-          // Release, fifth goes to minor third
-          TRP(+5, +3, +5);
-          next.tag = TAG_MINOR;
-          break;
-        default:
-          PANIC("case out of range");
+        skeleton_patch(b->skeleton, slot->data, voicing);
+        err = b->validate && skeleton_check(slot->data, size, voicing, seed);
       }
-      break;
     }
-    case TAG_DIMINISHED:
+    else if (!skipped)
     {
-      int case_ = RRANGE(0, 4);
-      fprintf(stderr, "diminished, case %d\n", case_);
-      switch (case_)
-      {
-        case 0:
-          // Make major on same base note
-          TRP(+0, +1, +1);
-          next.tag = TAG_MAJOR;
-          break;
-        case 1:
-          // Treat as D7<9 resolve to minor
-          TRP(-5, -5, -4);
-          next.tag = TAG_MINOR;
-          break;
-        case 2:
-          // Treat as D7 resolve to major
-          TRP(+1, +2, +2);
-          next.tag = TAG_MAJOR;
-          break;
-        case 3:
-          // Resolve low one down
-          TRP(-1, +0, +0);
-          next.tag = TAG_MAJOR;
-          break;
-        default:
-          PANIC("case out of range");
-      }
-      break;
+      midi_t mid = midi_create(fmt, div);
+      err = encode(&mid, voicing, NCHRDS);
+      size = err ? 0 : midi_size(&mid);
+      err = err ||
+            worker_reserve((void **) &slot->data, &slot->cap, size, 1) ||
+            midi_write_buffer(&mid, slot->data, size, 1);
+      midi_destroy(&mid);
     }
-    case TAG_AUGMENTED:
+    slot->size = size;
+    slot->seed = seed;
+    slot->hash = hash;
+    slot->skipped = skipped;
+
+    pthread_mutex_lock(&b->lock);
+    slot->ready = !err;
+    err = err || batch_commit(b);
+    if (err)
     {
-      int case_ = RRANGE(0, 3);
-      fprintf(stderr, "augmented, case %d\n", case_);
-      switch (case_)
-      {
-        case 0:
-          // Resolve high fifth to sixth
-          TRP(+9, +8, +8);
-          next.tag = TAG_MINOR;
-          break;
-        case 1:
-          // Resolve base down to make major chord
-          TRP(+4, +4, +3);
-          next.tag = TAG_MAJOR;
-          break;
-        case 2:
-          // Resolve middle up to make minor chord
-          TRP(+5, +4, +4);
-          next.tag = TAG_MINOR;
-          break;
-        default:
-          PANIC("case out of range");
-      }
+      atomic_store(&b->err, 1);
+      atomic_store(&b->next, b->count);
+    }
+    pthread_cond_broadcast(&b->turn);
+    pthread_mutex_unlock(&b->lock);
+    if (err)
       break;
+  }
+
+  PROF_FLUSH();
+  return NULL;
+}
+
+void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-s SEED] [-c START] [-m MODEL] [-t] [-v]\n"
+          "                          write one progression to stdout,\n"
+          "                          -m weights transitions by a trained model,\n"
+          "                          -t ties common tones over chord changes,\n"
+          "                          -v voices the whole progression for the\n"
+          "                          least movement instead of fixed octaves\n"
+          "       %s -p PACK [-n N] [-s SEED] [-c START] [-m MODEL] [-j THREADS]\n"
+          "          [-d] [-t] [-v] [-V]\n"
+          "                          write N progressions to PACK,\n"
+          "                          -d skips duplicates, -V checks the fast\n"
+          "                          path against midi_write\n"
+          "       %s -S SOCKET [-m MODEL] [-j THREADS] [-t] [-v]\n"
+          "                          serve requests on a Unix socket,\n"
+          "                          or on stdin if SOCKET is -\n",
+          prog, prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *pack_path = NULL;
+  const char *server_path = NULL;
+  unsigned long count = 1;
+  unsigned int seed = 0;
+  int nthreads = 1;
+  int use_dedup = 0;
+  int validate = 0;
+  ChordState start;
+  chst_init(&start, PCLS_C, TAG_MAJOR);
+  static Model loaded;
+  Model *model = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:S:n:s:c:m:j:dtvV")) != -1)
+  {
+    switch (opt)
+    {
+      case 'p': pack_path = optarg; break;
+      case 'S': server_path = optarg; break;
+      case 'n': count = strtoul(optarg, NULL, 0); break;
+      case 's':
+        // Seeds are 32 bits, wider ones would alias lower seeds
+        if (strtoull(optarg, NULL, 0) > UINT_MAX)
+        {
+          fprintf(stderr, "%s: seed out of range\n", optarg);
+          return 1;
+        }
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'c': if (chst_parse(&start, optarg)) usage(argv[0]); break;
+      case 'm':
+        if (model_load(&loaded, optarg))
+        {
+          fprintf(stderr, "%s: not a valid model file\n", optarg);
+          return 1;
+        }
+        model = &loaded;
+        break;
+      case 'j': nthreads = atoi(optarg); break;
+      case 'd': use_dedup = 1; break;
+      case 't': tie_notes = 1; break;
+      case 'v': optimize_voicing = 1; break;
+      case 'V': validate = 1; break;
+      default: usage(argv[0]);
     }
-    default:
-      PANIC("tag out of range");
   }
+  if (optind != argc || nthreads < 1)
+    usage(argv[0]);
+  if (pack_path && count && (unsigned long long) seed + count - 1 > UINT_MAX)
+  {
+    fprintf(stderr, "%lu progressions from seed %u: seed out of range\n",
+            count, seed);
+    return 1;
+  }
+
+  PROF_INIT();
+
+  if (server_path)
+  {
+    verbose = 0;
+    return serve(server_path, nthreads, model);
+  }
+
+  if (pack_path == NULL)
+  {
+    // Create Midi context
+    int div = midi_division_ticks_per_quarter_note(DIV);
+    int fmt = MIDI_FORMAT_SIMULTANEOUS;
+    midi_t mid = midi_create(fmt, div);
+
+    ChordState seq[NCHRDS];
+    Voicing voicing[NCHRDS];
+    uint8_t from[VOICE_SCRATCH(NCHRDS)];
+    generate(seq, NCHRDS, &start, model, seed);
+    voice(voicing, seq, NCHRDS, from);
+    int err = encode(&mid, voicing, NCHRDS);
+    PROF_BEGIN(PROF_WRITE);
+    err = err || midi_write(&mid, stdout) || fflush(stdout);
+    PROF_END(PROF_WRITE);
+    midi_destroy(&mid);
+    return err ? 1 : 0;
+  }
+
+  // One container with `count` progressions from consecutive seeds
+  verbose = 0;
+  static Batch b;
+  b.count = count;
+  b.seed = seed;
+  chst_copy(&b.start, &start);
+  b.model = model;
+  b.validate = validate;
+  b.use_dedup = use_dedup;
+  atomic_init(&b.next, 0);
+  atomic_init(&b.err, 0);
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.turn, NULL);
+
+  if (use_dedup && dedup_init(&b.dedup, count))
+  {
+    perror("dedup");
+    return 1;
+  }
+
+  // Every file has the same layout unless notes are tied
+  static Skeleton skeleton;
+  if (!tie_notes && skeleton_init(&skeleton, NCHRDS) == 0)
+    b.skeleton = &skeleton;
+
+  if (pack_writer_open(&b.pack, pack_path))
+  {
+    perror(pack_path);
+    return 1;
+  }
+
+  pthread_t *threads = malloc(sizeof(*threads) * nthreads);
+  int started = 0;
+  while (threads && started < nthreads &&
+         !pthread_create(&threads[started], NULL, batch_worker, &b))
+    started++;
+  if (started == 0)
+    batch_worker(&b);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  PROF_BEGIN(PROF_WRITE);
+  int err = pack_writer_close(&b.pack) || atomic_load(&b.err);
+  PROF_END(PROF_WRITE);
+  for (size_t i = 0; i < BATCH_WINDOW; i++)
+    free(b.slots[i].data);
+  if (b.skeleton)
+    skeleton_destroy(b.skeleton);
+  if (err)
+  {
+    perror(pack_path);
+    return 1;
+  }
+
+  if (use_dedup)
+  {
+    unsigned long seen = atomic_load(&b.dedup.seen);
+    unsigned long dups = atomic_load(&b.dedup.duplicates);
+    unsigned long overflows = atomic_load(&b.dedup.overflows);
+    fprintf(stderr, "dedup: %lu of %lu progressions were duplicates (%.2f%%)\n",
+            dups, seen, seen ? 100.0 * dups / seen : 0.0);
+    if (overflows)
+      fprintf(stderr, "dedup: table full, %lu progressions unchecked\n",
+              overflows);
+    dedup_free(&b.dedup);
+  }
+}
+
+void pick_next_chord(ChordState *curr, Model *const model)
+{
+  ChordState next;
+
+  LOG("tag: %d\n", curr->tag);
+  const RuleSet *set = &rules[curr->tag];
+  int case_ = model ? model_pick(model, curr->prev_tag, curr->tag)
+                    : RRANGE(0, (int) set->count);
+  LOG("%s, case %d\n", tag_names[curr->tag], case_);
+
+  const Rule *rule = &set->rules[case_];
+  for (size_t i = 0; i < 3; i++)
+    next.real_chord[i] = PCLS_WRAP(curr->real_chord[i] + rule->delta[i]);
+  next.tag = rule->tag;
+  next.prev_tag = curr->tag;
 
   // Make the chord "travel the least distance"
   int perm = lsd(curr->real_chord, next.real_chord);
-  fprintf(stderr, "optimal permutation: %d\n", perm);
+  LOG("optimal permutation: %d\n", perm);
   permute(next.chord, next.real_chord, perm);
   chst_copy(curr, &next);
 }
@@ -34,11 +34,15 @@
 
 #define MIDI_MESSAGE_NOTE_OFF_EVENT      8
 #define MIDI_MESSAGE_NOTE_ON_EVENT       9
+#define MIDI_MESSAGE_CONTROL_CHANGE     11
 #define MIDI_MESSAGE_PITCH_WHEEL_CHANGE 14
 /* TODO: More messages */
 
 #define MIDI_PITCH_WHEEL_CENTRE 0x2000
 
+/* Curve target other than a controller number */
+#define MIDI_CURVE_PITCH_WHEEL -1
+
 #define MIDI_TEXT_TEXT_EVENT             1
 #define MIDI_TEXT_COPYRIGHT_NOTICE       2
 #define MIDI_TEXT_SEQUENCE_OR_TRACK_NAME 3
@@ -58,41 +62,75 @@ typedef struct {
 
 typedef struct midi_track midi_track_t;
 
+typedef struct {
+    uint32_t tick;
+    int value;
+} midi_breakpoint_t;
+
+typedef int (*midi_curve_fn)(uint32_t tick, void *user);
+
 typedef struct {
     uint16_t format;
     uint16_t ntrks;
     uint16_t division;
-    midi_track_t *tracks;
+    midi_track_t **tracks;
+    size_t cap;
 } midi_t;
 
 midi_message_t midi_message_note_on(int channel, int key, int velocity);
 midi_message_t midi_message_note_off(int channel, int key, int velocity);
+midi_message_t midi_message_control_change(int channel, int controller,
+                                           int value);
 midi_message_t midi_message_pitch_wheel_change(int channel, int value);
 
 uint16_t midi_division_ticks_per_quarter_note(uint16_t ticks);
 
 midi_track_t *midi_track_create(void);
 void midi_track_destroy(midi_track_t * track);
+void midi_track_clear(midi_track_t * track);
 int midi_track_add_midi_message(midi_track_t * track, uint32_t dt,
                                 midi_message_t msg);
 int midi_track_add_end_of_track_event(midi_track_t * track, uint32_t dt);
 int midi_track_add_meta_event_text(midi_track_t * track, uint32_t dt,
                                    uint8_t kind, const char *text);
+int midi_track_add_curve(midi_track_t * track, uint32_t dt, int channel,
+                         int target, uint32_t len, midi_curve_fn fn,
+                         void *user, int tolerance, uint32_t * rest);
+int midi_track_add_curve_breakpoints(midi_track_t * track, uint32_t dt,
+                                     int channel, int target,
+                                     const midi_breakpoint_t * points,
+                                     size_t npoints, int tolerance,
+                                     uint32_t * rest);
 
 midi_t midi_create(uint16_t format, uint16_t division);
 void midi_destroy(midi_t * midi);
-void midi_add_track(midi_t * midi, midi_track_t * track);
+int midi_add_track(midi_t * midi, midi_track_t * track);
+size_t midi_size(midi_t * midi);
 int midi_write(midi_t * midi, FILE * f);
+int midi_write_buffer(midi_t * midi, uint8_t * buf, size_t size,
+                      int nthreads);
 
 #endif                          /* MIDI_H */
 
 #ifdef MIDI_IMPLEMENTATION
 #undef MIDI_IMPLEMENTATION
 
+#ifndef MIDI_NO_THREADS
+#include <pthread.h>
+#endif
+
 #define MIDI_TRACK_INITIAL_CAPACITY 16
 
+/* Called before every reallocation of a track buffer, e.g. to count them */
+#ifndef MIDI_TRACK_GROW
+#define MIDI_TRACK_GROW()
+#endif
+
+/* Below this many bytes midi_write_buffer copies on the calling thread */
+#define MIDI_PARALLEL_MIN_SIZE (1 << 20)
+#define MIDI_MAX_THREADS 64
+
 struct midi_track {
-    struct midi_track *next;
     uint8_t *data;
     size_t size;
     size_t cap;
@@ -146,6 +184,17 @@ midi_message_t midi_message_note_off(int channel, int key, int velocity)
     return msg;
 }
 
+midi_message_t midi_message_control_change(int channel, int controller,
+                                           int value)
+{
+    midi_message_t msg = { 0 };
+    msg.status = channel & 0xf;
+    msg.status |= MIDI_MESSAGE_CONTROL_CHANGE << 4;
+    msg.data[0] = controller & 0x7f;
+    msg.data[1] = value & 0x7f;
+    return msg;
+}
+
 midi_message_t midi_message_pitch_wheel_change(int channel, int value)
 {
     midi_message_t msg = { 0 };
@@ -168,7 +217,6 @@ midi_track_t *midi_track_create(void)
         return NULL;
     }
 
-    track->next = NULL;
     track->cap = MIDI_TRACK_INITIAL_CAPACITY;
     track->data = malloc(track->cap);
     track->size = 0;
@@ -187,6 +235,12 @@ void midi_track_destroy(midi_track_t *track)
     free(track);
 }
 
+/* Remove all events, keeping the buffer for reuse */
+void midi_track_clear(midi_track_t *track)
+{
+    track->size = 0;
+}
+
 static uint8_t *_midi_track_alloc(midi_track_t *track, size_t size)
 {
     if (track->size + size > track->cap) {
@@ -194,6 +248,7 @@ static uint8_t *_midi_track_alloc(midi_track_t *track, size_t size)
         while (track->size + size > cap) {
             cap *= 2;
         }
+        MIDI_TRACK_GROW();
         uint8_t *data = realloc(track->data, sizeof(*data) * cap);
         if (data == NULL) {
             return NULL;
@@ -249,6 +304,16 @@ static int _midi_track_write_to_file(midi_track_t *track, FILE *f)
     return MIDI_OK;
 }
 
+static void _midi_track_write_to_buffer(midi_track_t *track, uint8_t *buf)
+{
+    memcpy(buf, "MTrk", 4);
+    buf[4] = (track->size >> 24) & 0xff;
+    buf[5] = (track->size >> 16) & 0xff;
+    buf[6] = (track->size >> 8) & 0xff;
+    buf[7] = track->size & 0xff;
+    memcpy(&buf[8], track->data, track->size);
+}
+
 int midi_track_add_midi_message(midi_track_t *track, uint32_t dt,
                                 midi_message_t msg)
 {
@@ -317,6 +382,157 @@ int midi_track_add_meta_event_text(midi_track_t *track, uint32_t dt,
     return MIDI_OK;
 }
 
+static int _midi_track_add_curve_value(midi_track_t *track, uint32_t dt,
+                                       int channel, int target, int value)
+{
+    midi_message_t msg;
+
+    if (target == MIDI_CURVE_PITCH_WHEEL) {
+        msg = midi_message_pitch_wheel_change(channel, value);
+    } else {
+        msg = midi_message_control_change(channel, target, value);
+    }
+
+    return midi_track_add_midi_message(track, dt, msg);
+}
+
+/*
+ * Emit the curve `fn`, sampled at ticks [0, len) after a delay of `dt`, as
+ * pitch wheel (`target` = MIDI_CURVE_PITCH_WHEEL) or controller events.
+ *
+ * The receiver holds each value until the next event, so the curve is
+ * approximated by steps: every step covers the longest run of samples that
+ * fits in a band of 2 * `tolerance` and is sent at the middle of that band.
+ * This is the fewest events that keep every tick within `tolerance` of the
+ * curve, found in one pass. A step equal to the one before is not sent.
+ *
+ * The ticks between the last event and the end of the curve are stored in
+ * `rest`, to be added to the delta time of the next event on the track.
+ */
+int midi_track_add_curve(midi_track_t *track, uint32_t dt, int channel,
+                         int target, uint32_t len, midi_curve_fn fn,
+                         void *user, int tolerance, uint32_t *rest)
+{
+    const int max = target == MIDI_CURVE_PITCH_WHEEL ? 0x3fff : 0x7f;
+
+    uint32_t carry = dt;        /* Delta time owed by the next event */
+    uint32_t last = 0;          /* Tick of the last event */
+    int sent = -1;              /* Value of the last event */
+
+    uint32_t start = 0;
+    int lo = 0, hi = 0;
+
+    if (tolerance < 0) {
+        tolerance = 0;
+    }
+
+    for (uint32_t tick = 0; tick <= len; tick++) {
+        int value = 0;
+
+        if (tick < len) {
+            value = fn(tick, user);
+            value = value < 0 ? 0 : value > max ? max : value;
+
+            if (tick == 0) {
+                lo = hi = value;
+                continue;
+            }
+
+            int nlo = value < lo ? value : lo;
+            int nhi = value > hi ? value : hi;
+            if (nhi - nlo <= 2 * tolerance) {
+                lo = nlo;
+                hi = nhi;
+                continue;
+            }
+        } else if (len == 0) {
+            break;
+        }
+
+        /* Close the step [start, tick) */
+        int step = lo + (hi - lo) / 2;
+        if (step != sent) {
+            if (_midi_track_add_curve_value(track, carry + (start - last),
+                                            channel, target, step)) {
+                return MIDI_ERROR;
+            }
+            carry = 0;
+            last = start;
+            sent = step;
+        }
+
+        start = tick;
+        lo = hi = value;
+    }
+
+    if (rest) {
+        *rest = carry + (len - last);
+    }
+
+    return MIDI_OK;
+}
+
+struct _midi_breakpoint_cursor {
+    const midi_breakpoint_t *points;
+    size_t npoints;
+    size_t i;
+};
+
+/* Linear interpolation, sampled with increasing ticks */
+static int _midi_breakpoint_value(uint32_t tick, void *user)
+{
+    struct _midi_breakpoint_cursor *c = user;
+
+    while (c->i + 1 < c->npoints && c->points[c->i + 1].tick <= tick) {
+        c->i++;
+    }
+
+    const midi_breakpoint_t *a = &c->points[c->i];
+    if (c->i + 1 == c->npoints || tick <= a->tick) {
+        return a->value;
+    }
+
+    const midi_breakpoint_t *b = &c->points[c->i + 1];
+    int64_t num = (int64_t) (b->value - a->value) * (tick - a->tick);
+    int64_t den = b->tick - a->tick;
+    int64_t half = num < 0 ? -den / 2 : den / 2;
+    return a->value + (int) ((num + half) / den);
+}
+
+/*
+ * Like midi_track_add_curve, for the piecewise linear curve through
+ * `points`, sorted by tick. The curve ends at the last point, so `rest`
+ * counts the ticks from the last event to the tick of the last point.
+ */
+int midi_track_add_curve_breakpoints(midi_track_t *track, uint32_t dt,
+                                     int channel, int target,
+                                     const midi_breakpoint_t *points,
+                                     size_t npoints, int tolerance,
+                                     uint32_t *rest)
+{
+    if (npoints == 0) {
+        if (rest) {
+            *rest = dt;
+        }
+        return MIDI_OK;
+    }
+
+    struct _midi_breakpoint_cursor c = { points, npoints, 0 };
+    uint32_t len = points[npoints - 1].tick + 1;   /* Sample the last one */
+    uint32_t r;
+
+    if (midi_track_add_curve(track, dt, channel, target, len,
+                             _midi_breakpoint_value, &c, tolerance, &r)) {
+        return MIDI_ERROR;
+    }
+
+    /* Every event is at or before the last point, so `r` is at least 1 */
+    if (rest) {
+        *rest = r - 1;
+    }
+    return MIDI_OK;
+}
+
 midi_t midi_create(uint16_t format, uint16_t division)
 {
     midi_t f = { 0 };
@@ -324,36 +540,52 @@ midi_t midi_create(uint16_t format, uint16_t division)
     f.division = division;
     f.ntrks = 0;
     f.tracks = NULL;
+    f.cap = 0;
     return f;
 }
 
 void midi_destroy(midi_t *midi)
 {
-    midi_track_t *track = midi->tracks;
-    while (track) {
-        midi_track_t *tmp = track;
-        track = track->next;
-        midi_track_destroy(tmp);
+    for (size_t i = 0; i < midi->ntrks; i++) {
+        midi_track_destroy(midi->tracks[i]);
     }
+    free(midi->tracks);
     midi->tracks = NULL;
+    midi->ntrks = 0;
+    midi->cap = 0;
 }
 
-void midi_add_track(midi_t *midi, midi_track_t *track)
+/* Fails when out of memory or when the file already has 65535 tracks */
+int midi_add_track(midi_t *midi, midi_track_t *track)
 {
-    midi_track_t *ptr = midi->tracks;
+    if (midi->ntrks == UINT16_MAX) {
+        return MIDI_ERROR;
+    }
 
-    if (ptr == NULL) {
-        midi->tracks = track;
-        midi->ntrks++;
-        return;
+    if (midi->ntrks == midi->cap) {
+        size_t cap = midi->cap ? midi->cap * 2 : 4;
+        midi_track_t **tracks = realloc(midi->tracks, sizeof(*tracks) * cap);
+        if (tracks == NULL) {
+            return MIDI_ERROR;
+        }
+        midi->tracks = tracks;
+        midi->cap = cap;
     }
 
-    while (ptr->next) {
-        ptr = ptr->next;
+    midi->tracks[midi->ntrks++] = track;
+    return MIDI_OK;
+}
+
+/* Size in bytes of the file produced by midi_write */
+size_t midi_size(midi_t *midi)
+{
+    size_t size = 14;
+
+    for (size_t i = 0; i < midi->ntrks; i++) {
+        size += 8 + midi->tracks[i]->size;
     }
 
-    ptr->next = track;
-    midi->ntrks++;
+    return size;
 }
 
 int midi_write(midi_t *midi, FILE *f)
@@ -378,16 +610,120 @@ int midi_write(midi_t *midi, FILE *f)
         return MIDI_ERROR;
     }
 
-    midi_track_t *track = midi->tracks;
-
-    while (track) {
-        if (_midi_track_write_to_file(track, f)) {
+    for (size_t i = 0; i < midi->ntrks; i++) {
+        if (_midi_track_write_to_file(midi->tracks[i], f)) {
             return MIDI_ERROR;
         }
-        track = track->next;
     }
 
     return MIDI_OK;
 }
 
+struct _midi_copy_job {
+    midi_t *midi;
+    uint8_t *buf;
+    size_t *offsets;
+    size_t first;
+    size_t last;
+};
+
+static void *_midi_copy_tracks(void *arg)
+{
+    struct _midi_copy_job *job = arg;
+
+    for (size_t i = job->first; i < job->last; i++) {
+        _midi_track_write_to_buffer(job->midi->tracks[i],
+                                    &job->buf[job->offsets[i]]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Serialize into `buf`, which must hold at least midi_size() bytes. Track
+ * offsets are found by prefix sum up front so up to `nthreads` threads can
+ * copy disjoint runs of tracks at the same time.
+ */
+int midi_write_buffer(midi_t *midi, uint8_t *buf, size_t size, int nthreads)
+{
+    size_t total = midi_size(midi);
+    if (size < total) {
+        return MIDI_ERROR;
+    }
+
+    memcpy(buf, "MThd", 4);
+    const uint16_t hdr[] = { midi->format, midi->ntrks, midi->division };
+    buf[4] = buf[5] = buf[6] = 0;
+    buf[7] = 6;
+    for (size_t i = 0; i < 3; i++) {
+        buf[8 + 2 * i] = (hdr[i] >> 8) & 0xff;
+        buf[9 + 2 * i] = hdr[i] & 0xff;
+    }
+
+    size_t *offsets = malloc(sizeof(*offsets) * (midi->ntrks + 1));
+    if (offsets == NULL) {
+        return MIDI_ERROR;
+    }
+
+    offsets[0] = 14;
+    for (size_t i = 0; i < midi->ntrks; i++) {
+        offsets[i + 1] = offsets[i] + 8 + midi->tracks[i]->size;
+    }
+
+    if (nthreads > MIDI_MAX_THREADS) {
+        nthreads = MIDI_MAX_THREADS;
+    }
+    if (nthreads > midi->ntrks) {
+        nthreads = midi->ntrks;
+    }
+    if (nthreads < 1 || total < MIDI_PARALLEL_MIN_SIZE) {
+        nthreads = 1;
+    }
+
+    struct _midi_copy_job jobs[MIDI_MAX_THREADS];
+    size_t first = 0;
+
+    /* Split into runs of roughly equal byte count */
+    for (int t = 0; t < nthreads; t++) {
+        size_t goal = 14 + (total - 14) / nthreads * (t + 1);
+        size_t last = first;
+        while (last < midi->ntrks && (offsets[last] < goal ||
+                                      t == nthreads - 1)) {
+            last++;
+        }
+        jobs[t].midi = midi;
+        jobs[t].buf = buf;
+        jobs[t].offsets = offsets;
+        jobs[t].first = first;
+        jobs[t].last = last;
+        first = last;
+    }
+
+#ifndef MIDI_NO_THREADS
+    pthread_t threads[MIDI_MAX_THREADS];
+    int started[MIDI_MAX_THREADS];
+
+    for (int t = 1; t < nthreads; t++) {
+        started[t] = !pthread_create(&threads[t], NULL, _midi_copy_tracks,
+                                     &jobs[t]);
+        if (!started[t]) {
+            _midi_copy_tracks(&jobs[t]);
+        }
+    }
+    _midi_copy_tracks(&jobs[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+#else
+    for (int t = 0; t < nthreads; t++) {
+        _midi_copy_tracks(&jobs[t]);
+    }
+#endif
+
+    free(offsets);
+    return MIDI_OK;
+}
+
 #endif                          /* MIDI_IMPLEMENTATION */
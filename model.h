@@ -0,0 +1,112 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+// Transition weights learned from a corpus by `train`, counts of how often
+// each rule was taken out of each kind of chord, alone and after each kind
+// of chord before it. The file is "PMDL", a u32 version and then every
+// count as a little endian u32, first order before second order.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "definitions.h"
+#include "rules.h"
+
+#define MODEL_VERSION 1
+
+typedef struct {
+  uint32_t first[TAG_COUNT][MAX_RULES];
+  uint32_t second[TAG_COUNT][TAG_COUNT][MAX_RULES];  // [prev][tag][rule]
+} Model;
+
+#define MODEL_NCOUNTS (sizeof (Model) / sizeof (uint32_t))
+
+static inline void model_put_u32(uint8_t *p, uint32_t x)
+{
+  for (size_t i = 0; i < 4; i++)
+    p[i] = (x >> (8 * i)) & 0xff;
+}
+
+static inline uint32_t model_get_u32(const uint8_t *p)
+{
+  uint32_t x = 0;
+  for (size_t i = 0; i < 4; i++)
+    x |= (uint32_t) p[i] << (8 * i);
+  return x;
+}
+
+// Returns 0 on success
+int model_save(Model *const model, const char *path)
+{
+  uint8_t buf[8 + 4 * MODEL_NCOUNTS];
+  const uint32_t *counts = (const uint32_t *) model;
+
+  memcpy(buf, "PMDL", 4);
+  model_put_u32(&buf[4], MODEL_VERSION);
+  for (size_t i = 0; i < MODEL_NCOUNTS; i++)
+    model_put_u32(&buf[8 + 4 * i], counts[i]);
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return -1;
+  int err = fwrite(buf, 1, sizeof (buf), f) < sizeof (buf);
+  return fclose(f) || err ? -1 : 0;
+}
+
+// Returns 0 on success
+int model_load(Model *model, const char *path)
+{
+  uint8_t buf[8 + 4 * MODEL_NCOUNTS + 1];
+  uint32_t *counts = (uint32_t *) model;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return -1;
+  size_t n = fread(buf, 1, sizeof (buf), f);
+  fclose(f);
+
+  if (n != sizeof (buf) - 1 || memcmp(buf, "PMDL", 4) ||
+      model_get_u32(&buf[4]) != MODEL_VERSION)
+    return -1;
+
+  for (size_t i = 0; i < MODEL_NCOUNTS; i++)
+    counts[i] = model_get_u32(&buf[8 + 4 * i]);
+  return 0;
+}
+
+// Pick a rule out of `tag`, weighted by the second order counts after
+// `prev`, else the first order counts, else uniformly
+int model_pick(Model *const model, int prev, HarmTag tag)
+{
+  const uint32_t *row = NULL;
+  uint64_t total = 0;
+  size_t count = rules[tag].count;
+
+  if (prev >= 0)
+  {
+    row = model->second[prev][tag];
+    for (size_t i = 0; i < count; i++)
+      total += row[i];
+  }
+  if (total == 0)
+  {
+    row = model->first[tag];
+    for (size_t i = 0; i < count; i++)
+      total += row[i];
+  }
+  if (total == 0)
+    return RRANGE(0, (int) count);
+
+  uint64_t r = ((uint64_t) rand_r(&rng_state) << 31 | rand_r(&rng_state))
+               % total;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (r < row[i])
+      return i;
+    r -= row[i];
+  }
+  PANIC("weights out of range");
+  return 0;
+}
+
+#endif
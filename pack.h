@@ -0,0 +1,370 @@
+/*
+ * pack.h - indexed container holding many midi files
+ *
+ * Layout, all integers little endian:
+ *
+ *   header   "MPAK", u32 version
+ *   data     complete midi file images, back to back
+ *   index    count * { u64 offset, u64 length, u64 seed }
+ *   seeds    nslots * u64, entry number + 1 (0 = empty slot), open
+ *            addressing with linear probing on the hashed seed
+ *   trailer  u64 index offset, u64 count, u64 nslots, "MPAK", u32 version
+ *
+ * The writer only ever appends, through a large stdio buffer. The reader
+ * maps the whole file and finds entries by number or by seed in O(1).
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "midi.h"
+
+#define PACK_ERROR -1
+#define PACK_OK     0
+
+#define PACK_VERSION 1
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t seed;
+} pack_entry_t;
+
+typedef struct {
+    FILE *f;
+    char *buf;
+    uint64_t offset;
+    pack_entry_t *entries;
+    size_t count;
+    size_t cap;
+} pack_writer_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    const uint8_t *index;
+    const uint8_t *seeds;
+    uint64_t count;
+    uint64_t nslots;
+} pack_reader_t;
+
+int pack_writer_open(pack_writer_t * w, const char *path);
+int pack_writer_append(pack_writer_t * w, uint64_t seed, midi_t * midi);
+int pack_writer_append_bytes(pack_writer_t * w, uint64_t seed,
+                             const uint8_t * data, size_t size);
+int pack_writer_close(pack_writer_t * w);
+
+int pack_reader_open(pack_reader_t * r, const char *path);
+void pack_reader_close(pack_reader_t * r);
+int pack_reader_entry(pack_reader_t * r, uint64_t i, pack_entry_t * entry);
+int64_t pack_reader_find(pack_reader_t * r, uint64_t seed);
+
+#endif                          /* PACK_H */
+
+#ifdef PACK_IMPLEMENTATION
+#undef PACK_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PACK_WRITE_BUFFER_SIZE (1 << 22)
+#define PACK_HEADER_SIZE        8
+#define PACK_INDEX_ENTRY_SIZE  24
+#define PACK_TRAILER_SIZE      32
+
+static void _pack_put_u32(uint8_t *p, uint32_t x)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (x >> (8 * i)) & 0xff;
+    }
+}
+
+static void _pack_put_u64(uint8_t *p, uint64_t x)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (x >> (8 * i)) & 0xff;
+    }
+}
+
+static uint32_t _pack_get_u32(const uint8_t *p)
+{
+    uint32_t x = 0;
+    for (int i = 0; i < 4; i++) {
+        x |= (uint32_t) p[i] << (8 * i);
+    }
+    return x;
+}
+
+static uint64_t _pack_get_u64(const uint8_t *p)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= (uint64_t) p[i] << (8 * i);
+    }
+    return x;
+}
+
+/* splitmix64 finalizer */
+static uint64_t _pack_hash(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+int pack_writer_open(pack_writer_t *w, const char *path)
+{
+    memset(w, 0, sizeof(*w));
+
+    w->f = fopen(path, "wb");
+    if (w->f == NULL) {
+        return PACK_ERROR;
+    }
+
+    w->buf = malloc(PACK_WRITE_BUFFER_SIZE);
+    if (w->buf) {
+        setvbuf(w->f, w->buf, _IOFBF, PACK_WRITE_BUFFER_SIZE);
+    }
+
+    uint8_t hdr[PACK_HEADER_SIZE];
+    memcpy(hdr, "MPAK", 4);
+    _pack_put_u32(&hdr[4], PACK_VERSION);
+
+    if (fwrite(hdr, 1, sizeof(hdr), w->f) < sizeof(hdr)) {
+        fclose(w->f);
+        free(w->buf);
+        memset(w, 0, sizeof(*w));
+        return PACK_ERROR;
+    }
+
+    w->offset = sizeof(hdr);
+    return PACK_OK;
+}
+
+static int _pack_writer_reserve(pack_writer_t *w)
+{
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        pack_entry_t *entries = realloc(w->entries, sizeof(*entries) * cap);
+        if (entries == NULL) {
+            return PACK_ERROR;
+        }
+        w->entries = entries;
+        w->cap = cap;
+    }
+
+    return PACK_OK;
+}
+
+static void _pack_writer_add_entry(pack_writer_t *w, uint64_t seed,
+                                   uint64_t length)
+{
+    pack_entry_t *entry = &w->entries[w->count++];
+    entry->offset = w->offset;
+    entry->length = length;
+    entry->seed = seed;
+
+    w->offset += length;
+}
+
+int pack_writer_append(pack_writer_t *w, uint64_t seed, midi_t *midi)
+{
+    if (_pack_writer_reserve(w) || midi_write(midi, w->f)) {
+        return PACK_ERROR;
+    }
+
+    _pack_writer_add_entry(w, seed, midi_size(midi));
+    return PACK_OK;
+}
+
+/* Append an already serialized midi file */
+int pack_writer_append_bytes(pack_writer_t *w, uint64_t seed,
+                             const uint8_t *data, size_t size)
+{
+    if (_pack_writer_reserve(w) || fwrite(data, 1, size, w->f) < size) {
+        return PACK_ERROR;
+    }
+
+    _pack_writer_add_entry(w, seed, size);
+    return PACK_OK;
+}
+
+int pack_writer_close(pack_writer_t *w)
+{
+    int err = PACK_OK;
+    uint8_t buf[PACK_TRAILER_SIZE];
+
+    for (size_t i = 0; i < w->count; i++) {
+        _pack_put_u64(&buf[0], w->entries[i].offset);
+        _pack_put_u64(&buf[8], w->entries[i].length);
+        _pack_put_u64(&buf[16], w->entries[i].seed);
+        if (fwrite(buf, 1, PACK_INDEX_ENTRY_SIZE, w->f) <
+            PACK_INDEX_ENTRY_SIZE) {
+            err = PACK_ERROR;
+            goto out;
+        }
+    }
+
+    /* Keep the seed table at most half full */
+    uint64_t nslots = 1;
+    while (nslots < 2 * w->count) {
+        nslots *= 2;
+    }
+
+    uint64_t *slots = calloc(nslots, sizeof(*slots));
+    if (slots == NULL) {
+        err = PACK_ERROR;
+        goto out;
+    }
+
+    for (size_t i = 0; i < w->count; i++) {
+        uint64_t seed = w->entries[i].seed;
+        uint64_t slot = _pack_hash(seed) & (nslots - 1);
+        while (slots[slot] && w->entries[slots[slot] - 1].seed != seed) {
+            slot = (slot + 1) & (nslots - 1);
+        }
+        if (slots[slot] == 0) {
+            slots[slot] = i + 1;
+        }
+    }
+
+    for (uint64_t i = 0; i < nslots; i++) {
+        _pack_put_u64(buf, slots[i]);
+        if (fwrite(buf, 1, 8, w->f) < 8) {
+            err = PACK_ERROR;
+            break;
+        }
+    }
+    free(slots);
+
+    if (err) {
+        goto out;
+    }
+
+    _pack_put_u64(&buf[0], w->offset);
+    _pack_put_u64(&buf[8], w->count);
+    _pack_put_u64(&buf[16], nslots);
+    memcpy(&buf[24], "MPAK", 4);
+    _pack_put_u32(&buf[28], PACK_VERSION);
+
+    if (fwrite(buf, 1, PACK_TRAILER_SIZE, w->f) < PACK_TRAILER_SIZE) {
+        err = PACK_ERROR;
+    }
+
+  out:
+    if (fclose(w->f)) {
+        err = PACK_ERROR;
+    }
+    free(w->buf);
+    free(w->entries);
+    memset(w, 0, sizeof(*w));
+    return err;
+}
+
+int pack_reader_open(pack_reader_t *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return PACK_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size <
+        PACK_HEADER_SIZE + PACK_TRAILER_SIZE) {
+        close(fd);
+        return PACK_ERROR;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return PACK_ERROR;
+    }
+
+    r->data = data;
+    r->size = st.st_size;
+
+    const uint8_t *trailer = r->data + r->size - PACK_TRAILER_SIZE;
+    uint64_t index_offset = _pack_get_u64(&trailer[0]);
+    r->count = _pack_get_u64(&trailer[8]);
+    r->nslots = _pack_get_u64(&trailer[16]);
+
+    if (memcmp(r->data, "MPAK", 4) || memcmp(&trailer[24], "MPAK", 4) ||
+        _pack_get_u32(&trailer[28]) != PACK_VERSION ||
+        index_offset > r->size - PACK_TRAILER_SIZE ||
+        r->count > r->size / PACK_INDEX_ENTRY_SIZE ||
+        r->nslots > r->size / 8 ||
+        (r->size - index_offset - PACK_TRAILER_SIZE) / 8 !=
+        r->count * 3 + r->nslots) {
+        pack_reader_close(r);
+        return PACK_ERROR;
+    }
+
+    r->index = r->data + index_offset;
+    r->seeds = r->index + r->count * PACK_INDEX_ENTRY_SIZE;
+    return PACK_OK;
+}
+
+void pack_reader_close(pack_reader_t *r)
+{
+    if (r->data) {
+        munmap((void *) r->data, r->size);
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+int pack_reader_entry(pack_reader_t *r, uint64_t i, pack_entry_t *entry)
+{
+    if (i >= r->count) {
+        return PACK_ERROR;
+    }
+
+    const uint8_t *p = r->index + i * PACK_INDEX_ENTRY_SIZE;
+    entry->offset = _pack_get_u64(&p[0]);
+    entry->length = _pack_get_u64(&p[8]);
+    entry->seed = _pack_get_u64(&p[16]);
+
+    if (entry->offset > r->size || entry->length > r->size - entry->offset) {
+        return PACK_ERROR;
+    }
+
+    return PACK_OK;
+}
+
+/* Entry number of the first entry generated from `seed`, or -1 */
+int64_t pack_reader_find(pack_reader_t *r, uint64_t seed)
+{
+    if (r->nslots == 0) {
+        return -1;
+    }
+
+    uint64_t slot = _pack_hash(seed) & (r->nslots - 1);
+
+    for (uint64_t probe = 0; probe < r->nslots; probe++) {
+        uint64_t i = _pack_get_u64(r->seeds + slot * 8);
+        if (i == 0 || i > r->count) {
+            return -1;
+        }
+        if (_pack_get_u64(r->index + (i - 1) * PACK_INDEX_ENTRY_SIZE + 16)
+            == seed) {
+            return i - 1;
+        }
+        slot = (slot + 1) & (r->nslots - 1);
+    }
+
+    return -1;
+}
+
+#endif                          /* PACK_IMPLEMENTATION */
@@ -0,0 +1,139 @@
+#ifndef PROF_H
+#define PROF_H
+
+// Stage timers and counters. Built with -DPROFILE every run writes a JSON
+// summary at exit, to the file named by $PROGRESSIONS_PROFILE or to
+// stderr; without it all of the macros below expand to nothing. Stages
+// are timed once per progression, never per chord or event, so that
+// reading the clock stays cheap next to the work it measures.
+
+typedef enum {
+  PROF_GENERATE,  // Picking all chords of a progression
+  PROF_ENCODE,
+  PROF_WRITE,
+  PROF_STAGE_COUNT,
+} ProfStage;
+
+typedef enum {
+  PROF_PROGRESSIONS,
+  PROF_TRACKS,
+  PROF_EVENTS,
+  PROF_BYTES,
+  PROF_REALLOCS,  // Track buffer reallocations
+  PROF_COUNTER_COUNT,
+} ProfCounter;
+
+#ifdef PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct {
+  uint64_t ns[PROF_STAGE_COUNT];
+  uint64_t calls[PROF_STAGE_COUNT];
+  uint64_t counters[PROF_COUNTER_COUNT];
+} ProfData;
+
+const char *const prof_stage_names[PROF_STAGE_COUNT] = {
+  "generate", "encode", "write",
+};
+
+const char *const prof_counter_names[PROF_COUNTER_COUNT] = {
+  "progressions", "tracks", "events", "bytes_encoded", "reallocs",
+};
+
+// Each thread counts into its own copy, merged by prof_flush
+_Thread_local ProfData prof_local;
+ProfData prof_total;
+pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t prof_start;
+
+static inline uint64_t prof_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Merge the calling thread's numbers into the total
+void prof_flush(void)
+{
+  pthread_mutex_lock(&prof_lock);
+  for (size_t i = 0; i < PROF_STAGE_COUNT; i++)
+  {
+    prof_total.ns[i] += prof_local.ns[i];
+    prof_total.calls[i] += prof_local.calls[i];
+  }
+  for (size_t i = 0; i < PROF_COUNTER_COUNT; i++)
+    prof_total.counters[i] += prof_local.counters[i];
+  pthread_mutex_unlock(&prof_lock);
+  memset(&prof_local, 0, sizeof (ProfData));
+}
+
+void prof_dump(void)
+{
+  prof_flush();
+
+  const char *path = getenv("PROGRESSIONS_PROFILE");
+  FILE *f = path ? fopen(path, "w") : stderr;
+  if (f == NULL)
+  {
+    perror(path);
+    return;
+  }
+
+  fprintf(f, "{\n  \"wall_ns\": %llu,\n  \"stages\": {\n",
+          (unsigned long long) (prof_now() - prof_start));
+  for (size_t i = 0; i < PROF_STAGE_COUNT; i++)
+    fprintf(f, "    \"%s\": { \"calls\": %llu, \"ns\": %llu }%s\n",
+            prof_stage_names[i],
+            (unsigned long long) prof_total.calls[i],
+            (unsigned long long) prof_total.ns[i],
+            i + 1 < PROF_STAGE_COUNT ? "," : "");
+  fprintf(f, "  },\n  \"counters\": {\n");
+  for (size_t i = 0; i < PROF_COUNTER_COUNT; i++)
+    fprintf(f, "    \"%s\": %llu,\n", prof_counter_names[i],
+            (unsigned long long) prof_total.counters[i]);
+  uint64_t tracks = prof_total.counters[PROF_TRACKS];
+  fprintf(f, "    \"events_per_track\": %.1f\n  }\n}\n",
+          tracks ? (double) prof_total.counters[PROF_EVENTS] / tracks : 0.0);
+
+  if (f != stderr)
+    fclose(f);
+}
+
+void prof_init(void)
+{
+  prof_start = prof_now();
+  atexit(prof_dump);
+}
+
+#define PROF_INIT() prof_init()
+#define PROF_FLUSH() prof_flush()
+#define PROF_BEGIN(stage) uint64_t _prof_##stage = prof_now()
+#define PROF_END(stage) \
+  (prof_local.ns[stage] += prof_now() - _prof_##stage, \
+   prof_local.calls[stage]++)
+#define PROF_COUNT(counter, n) (prof_local.counters[counter] += (n))
+// Leave out everything between the two, such as encoding that only checks
+// or prepares other work
+#define PROF_SUSPEND() ProfData _prof_saved = prof_local
+#define PROF_RESUME() (prof_local = _prof_saved)
+
+#else
+
+#define PROF_INIT()
+#define PROF_FLUSH()
+#define PROF_BEGIN(stage)
+#define PROF_END(stage)
+#define PROF_COUNT(counter, n)
+#define PROF_SUSPEND()
+#define PROF_RESUME()
+
+#endif
+
+#endif
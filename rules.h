@@ -0,0 +1,104 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include "definitions.h"
+
+// A chord transition: how far each voice of `real_chord` moves, and what
+// kind of chord that makes
+typedef struct {
+  int8_t delta[3];
+  HarmTag tag;
+} Rule;
+
+#define MAX_RULES 10
+
+typedef struct {
+  size_t count;
+  Rule rules[MAX_RULES];
+} RuleSet;
+
+// Transitions out of each kind of chord, picked from by pick_next_chord
+const RuleSet rules[TAG_COUNT] = {
+  [TAG_MAJOR] = { 10, {
+    // Transpose major chord a whole step down
+    { { -2, -2, -2 }, TAG_MAJOR },
+    // Transpose major chord a whole step down, make minor
+    { { -2, -3, -2 }, TAG_MINOR },
+    // Transpose a minor third up
+    { { +3, +3, +3 }, TAG_MAJOR },
+    // Transpose a major third up, make minor
+    { { +4, +3, +4 }, TAG_MINOR },
+    // Transpose to dominant, suspended
+    { { -5, -4, -5 }, TAG_SUSPENDED },
+    // Transpose a whole step up, suspended
+    { { +2, +3, +2 }, TAG_SUSPENDED },
+    // Make suspended
+    { { +0, +1, +0 }, TAG_SUSPENDED },
+    // Make dominant without one
+    { { +4, +3, +3 }, TAG_DIMINISHED },
+    // To dominant with low nine
+    { { +5, +4, +4 }, TAG_DIMINISHED },
+    // Raise fifth
+    { { +0, +0, +1 }, TAG_AUGMENTED },
+  } },
+  [TAG_MINOR] = { 10, {
+    // Transpose minor chord a major third down
+    { { -4, -4, -4 }, TAG_MINOR },
+    // Transpose minor chord a fourth, make major
+    { { +5, +6, +5 }, TAG_MAJOR },
+    // Transpose a fourth down
+    { { -5, -5, -5 }, TAG_MINOR },
+    // Transpose a whole step down, make major
+    { { -2, -1, -2 }, TAG_MAJOR },
+    // Transpose to dominant, suspended
+    { { -5, -3, -5 }, TAG_SUSPENDED },
+    // Transpose to subdominant, suspended
+    { { +5, +7, +5 }, TAG_SUSPENDED },
+    // Make suspended
+    { { +0, +2, +0 }, TAG_SUSPENDED },
+    // Lower fifth
+    { { +0, +0, -1 }, TAG_DIMINISHED },
+    // Add high sixth
+    { { -3, -3, -4 }, TAG_DIMINISHED },
+    // Lower base
+    { { -1, +0, +0 }, TAG_AUGMENTED },
+  } },
+  [TAG_SUSPENDED] = { 4, {
+    // Release, fourth goes to major third
+    { { +0, -1, +0 }, TAG_MAJOR },
+    // Release, fourth goes to minor third
+    { { +0, -2, +0 }, TAG_MINOR },
+    // Release, fifth goes to major third
+    { { +5, +4, +5 }, TAG_MAJOR },
+    // Release, fifth goes to minor third
+    { { +5, +3, +5 }, TAG_MINOR },
+  } },
+  [TAG_DIMINISHED] = { 4, {
+    // Make major on same base note
+    { { +0, +1, +1 }, TAG_MAJOR },
+    // Treat as D7<9 resolve to minor
+    { { -5, -5, -4 }, TAG_MINOR },
+    // Treat as D7 resolve to major
+    { { +1, +2, +2 }, TAG_MAJOR },
+    // Resolve low one down
+    { { -1, +0, +0 }, TAG_MAJOR },
+  } },
+  [TAG_AUGMENTED] = { 3, {
+    // Resolve high fifth to sixth
+    { { +9, +8, +8 }, TAG_MINOR },
+    // Resolve base down to make major chord
+    { { +4, +4, +3 }, TAG_MAJOR },
+    // Resolve middle up to make minor chord
+    { { +5, +4, +4 }, TAG_MINOR },
+  } },
+};
+
+const char *const tag_names[TAG_COUNT] = {
+  [TAG_MAJOR]      = "major",
+  [TAG_MINOR]      = "minor",
+  [TAG_SUSPENDED]  = "suspended",
+  [TAG_DIMINISHED] = "diminished",
+  [TAG_AUGMENTED]  = "augmented",
+};
+
+#endif
@@ -0,0 +1,482 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Generation server, `main -S SOCKET`. Reads requests one per line and
+// answers each with a complete midi file:
+//
+//   SEED LENGTH START RULES   e.g. "7 32 C default", RULES is "default"
+//                             or "model" when started with -m
+//   STATS                     latency percentiles so far, as text
+//
+//   OK <size>\n followed by <size> bytes
+//   ERR <message>\n
+//
+// Workers are handed requests, not connections: all of them wait on one
+// epoll set, and a connection with a complete line is taken by one worker
+// at a time, which answers every line it has read and gives the connection
+// back. Idle connections hold no worker, and the answers on a connection
+// stay in the order of its requests.
+//
+// Every worker thread keeps its tracks and output buffer between requests,
+// so a warm request does no allocation at all. On SIGINT or SIGTERM the
+// workers are woken and joined, so that their profile is merged before
+// exit.
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "latency.h"
+
+#define SERVER_MAX_LENGTH (1 << 20)
+
+// Requests between merges of a worker's profile, which takes a global lock
+#define SERVER_FLUSH_EVERY 1024
+
+// Longest request line, a longer one closes the connection
+#define SERVER_MAX_LINE 1024
+
+// From main.c
+uint64_t generate(ChordState *seq, size_t n, ChordState *const start,
+                  Model *const model, unsigned int seed);
+int encode_tracks(midi_track_t *main_trk, midi_track_t *base_trk,
+                  Voicing *voicing, size_t n);
+
+typedef struct {
+  midi_t mid;
+  ChordState *seq;
+  size_t seq_cap;
+  Voicing *voicing;
+  size_t voicing_cap;
+  uint8_t *from;  // Scratch for voice
+  size_t from_cap;
+  uint8_t *out;
+  size_t out_cap;
+  unsigned long served;
+} Worker;
+
+// A client connection and the part of a request line read so far
+typedef struct Conn {
+  int fd;
+  size_t len;
+  char buf[SERVER_MAX_LINE];
+  struct Conn *prev, *next;  // In server_conns
+} Conn;
+
+LatencyHist server_latency;  // Progressions only
+atomic_ulong server_errors;  // ERR answers
+int server_fd = -1;
+int server_epoll = -1;
+int server_wake[2] = { -1, -1 };  // Readable once stopping
+Model *server_model;
+
+// Every open connection, to close them on shutdown
+Conn *server_conns;
+pthread_mutex_t server_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void server_report(FILE *f)
+{
+  lat_report(&server_latency, f);
+  fprintf(f, "errors %lu\n", atomic_load(&server_errors));
+}
+
+int worker_init(Worker *w)
+{
+  memset(w, 0, sizeof (Worker));
+  int div = midi_division_ticks_per_quarter_note(DIV);
+  w->mid = midi_create(MIDI_FORMAT_SIMULTANEOUS, div);
+
+  for (size_t i = 0; i < 2; i++)
+  {
+    midi_track_t *trk = midi_track_create();
+    if (trk == NULL || midi_add_track(&w->mid, trk))
+      return -1;
+  }
+  return 0;
+}
+
+void worker_destroy(Worker *w)
+{
+  midi_destroy(&w->mid);
+  free(w->seq);
+  free(w->voicing);
+  free(w->from);
+  free(w->out);
+}
+
+// Grow `*buf` to hold at least `size` elements of `elem` bytes
+int worker_reserve(void **buf, size_t *cap, size_t size, size_t elem)
+{
+  if (size <= *cap)
+    return 0;
+  size_t new_cap = *cap ? *cap : 64;
+  while (new_cap < size)
+    new_cap *= 2;
+  void *p = realloc(*buf, new_cap * elem);
+  if (p == NULL)
+    return -1;
+  *buf = p;
+  *cap = new_cap;
+  return 0;
+}
+
+int write_all(int fd, const void *buf, size_t size)
+{
+  const uint8_t *p = buf;
+  while (size)
+  {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Returns -1 when `fd` is gone, else 1
+int reply_error(int fd, const char *msg)
+{
+  char buf[128];
+  int n = snprintf(buf, sizeof (buf), "ERR %s\n", msg);
+  atomic_fetch_add(&server_errors, 1);
+  return write_all(fd, buf, n) ? -1 : 1;
+}
+
+// Answer the request `line` on `fd`. Returns -1 when `fd` is gone, 0 after
+// sending a progression and 1 after any other answer
+int serve_request(Worker *w, char *line, int fd)
+{
+  if (strcmp(line, "STATS") == 0)
+  {
+    char body[256], hdr[32];
+    FILE *f = fmemopen(body, sizeof (body), "w");
+    if (f == NULL)
+      return reply_error(fd, "out of memory");
+    server_report(f);
+    long n = ftell(f);
+    fclose(f);
+    int m = snprintf(hdr, sizeof (hdr), "OK %ld\n", n);
+    return write_all(fd, hdr, m) || write_all(fd, body, n) ? -1 : 1;
+  }
+
+  unsigned long seed, length;
+  char start_name[16], rule_set[16];
+  ChordState start;
+
+  if (sscanf(line, "%lu %lu %15s %15s", &seed, &length, start_name,
+             rule_set) != 4)
+    return reply_error(fd, "expected SEED LENGTH START RULES");
+  if (seed > UINT_MAX)
+    return reply_error(fd, "seed out of range");
+  if (length == 0 || length > SERVER_MAX_LENGTH)
+    return reply_error(fd, "length out of range");
+  if (chst_parse(&start, start_name))
+    return reply_error(fd, "bad start chord");
+  Model *model;
+  if (strcmp(rule_set, "default") == 0)
+    model = NULL;
+  else if (strcmp(rule_set, "model") == 0 && server_model)
+    model = server_model;
+  else
+    return reply_error(fd, "unknown rule set");
+
+  if (worker_reserve((void **) &w->seq, &w->seq_cap, length,
+                     sizeof (ChordState)) ||
+      worker_reserve((void **) &w->voicing, &w->voicing_cap, length,
+                     sizeof (Voicing)) ||
+      worker_reserve((void **) &w->from, &w->from_cap,
+                     VOICE_SCRATCH(length), 1))
+    return reply_error(fd, "out of memory");
+
+  generate(w->seq, length, &start, model, seed);
+  voice(w->voicing, w->seq, length, w->from);
+
+  midi_track_t *main_trk = w->mid.tracks[0];
+  midi_track_t *base_trk = w->mid.tracks[1];
+  midi_track_clear(main_trk);
+  midi_track_clear(base_trk);
+  if (encode_tracks(main_trk, base_trk, w->voicing, length))
+    return reply_error(fd, "out of memory");
+
+  // Room for the "OK <size>\n" line in front of the file
+  size_t size = midi_size(&w->mid);
+  if (worker_reserve((void **) &w->out, &w->out_cap, size + 32, 1))
+    return reply_error(fd, "out of memory");
+
+  int hdr = snprintf((char *) w->out, 32, "OK %zu\n", size);
+  midi_write_buffer(&w->mid, w->out + hdr, size, 1);
+  if (++w->served % SERVER_FLUSH_EVERY == 0)
+  {
+    PROF_FLUSH();
+  }
+  return write_all(fd, w->out, hdr + size) ? -1 : 0;
+}
+
+// Serve the request `line` of `n` bytes, ending in a newline or not, and
+// record its latency if it was a progression. Returns -1 when `fd` is gone
+int serve_line(Worker *w, char *line, size_t n, int fd)
+{
+  uint64_t t0 = lat_now();
+  while (n && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+    n--;
+  line[n] = '\0';
+  if (n == 0)
+    return 0;
+
+  int ret = serve_request(w, line, fd);
+  if (ret == 0)
+    lat_record(&server_latency, lat_now() - t0);
+  return ret < 0 ? -1 : 0;
+}
+
+// Serve requests from `in` until it ends or `out` is gone
+void serve_stream(Worker *w, FILE *in, int out)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+
+  while ((n = getline(&line, &cap, in)) > 0)
+    if (serve_line(w, line, n, out))
+      break;
+
+  free(line);
+  PROF_FLUSH();
+}
+
+void conn_close(Conn *c)
+{
+  pthread_mutex_lock(&server_conns_lock);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    server_conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  pthread_mutex_unlock(&server_conns_lock);
+
+  close(c->fd);
+  free(c);
+}
+
+// Wait for the next readable connection, one at a time
+int conn_arm(Conn *c, int op)
+{
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = c };
+  return epoll_ctl(server_epoll, op, c->fd, &ev);
+}
+
+// Take every pending connection, then wait for the next one
+void server_accept(void)
+{
+  int fd;
+  while ((fd = accept(server_fd, NULL, NULL)) >= 0)
+  {
+    Conn *c = malloc(sizeof (Conn));
+    if (c == NULL)
+    {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->len = 0;
+    c->prev = NULL;
+
+    pthread_mutex_lock(&server_conns_lock);
+    c->next = server_conns;
+    if (server_conns)
+      server_conns->prev = c;
+    server_conns = c;
+    pthread_mutex_unlock(&server_conns_lock);
+
+    if (conn_arm(c, EPOLL_CTL_ADD))
+      conn_close(c);
+  }
+
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT,
+                            .data.ptr = &server_fd };
+  epoll_ctl(server_epoll, EPOLL_CTL_MOD, server_fd, &ev);
+}
+
+// Answer every complete line that has arrived on `c`, then give it back.
+// Returns -1 when the connection is done
+int serve_conn(Worker *w, Conn *c)
+{
+  ssize_t n = recv(c->fd, c->buf + c->len, sizeof (c->buf) - c->len,
+                   MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return conn_arm(c, EPOLL_CTL_MOD);
+  if (n <= 0)
+    return -1;
+  c->len += n;
+
+  char *line = c->buf, *end;
+  while ((end = memchr(line, '\n', c->buf + c->len - line)))
+  {
+    if (serve_line(w, line, end - line, c->fd))
+      return -1;
+    line = end + 1;
+  }
+
+  c->len -= line - c->buf;
+  memmove(c->buf, line, c->len);
+  if (c->len == sizeof (c->buf))
+  {
+    reply_error(c->fd, "line too long");
+    return -1;
+  }
+  return conn_arm(c, EPOLL_CTL_MOD);
+}
+
+void *server_worker(void *arg)
+{
+  Worker *w = arg;
+
+  for (;;)
+  {
+    struct epoll_event ev;
+    int n = epoll_wait(server_epoll, &ev, 1, -1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 || ev.data.ptr == server_wake)
+      break;
+
+    if (ev.data.ptr == &server_fd)
+      server_accept();
+    else if (serve_conn(w, ev.data.ptr))
+    {
+      conn_close(ev.data.ptr);
+      PROF_FLUSH();
+    }
+  }
+
+  PROF_FLUSH();
+  return NULL;
+}
+
+// Serve on the Unix socket at `path` with `nthreads` workers until
+// SIGINT or SIGTERM, or on stdin and stdout if `path` is "-". The "model"
+// rule set is `model`, if not NULL
+int serve(const char *path, int nthreads, Model *model)
+{
+  server_model = model;
+
+  if (strcmp(path, "-") == 0)
+  {
+    Worker w;
+    if (worker_init(&w))
+    {
+      perror("worker");
+      worker_destroy(&w);
+      return 1;
+    }
+    serve_stream(&w, stdin, STDOUT_FILENO);
+    worker_destroy(&w);
+    server_report(stderr);
+    return 0;
+  }
+
+  struct sockaddr_un addr = { 0 };
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof (addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  unlink(path);
+  if (server_fd < 0 ||
+      bind(server_fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+      listen(server_fd, SOMAXCONN))
+  {
+    perror(path);
+    return 1;
+  }
+
+  // The listener is taken by one worker at a time like a connection, the
+  // wake pipe by all of them at once
+  struct epoll_event listen_ev = { .events = EPOLLIN | EPOLLONESHOT,
+                                   .data.ptr = &server_fd };
+  struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = server_wake };
+  server_epoll = epoll_create1(0);
+  if (server_epoll < 0 || pipe(server_wake) ||
+      epoll_ctl(server_epoll, EPOLL_CTL_ADD, server_fd, &listen_ev) ||
+      epoll_ctl(server_epoll, EPOLL_CTL_ADD, server_wake[0], &wake_ev))
+  {
+    perror("epoll");
+    unlink(path);
+    return 1;
+  }
+
+  // Workers never see the signals, main waits for them below
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  Worker *workers = calloc(nthreads, sizeof (Worker));
+  pthread_t *threads = calloc(nthreads, sizeof (pthread_t));
+  if (workers == NULL || threads == NULL)
+  {
+    perror("serve");
+    unlink(path);
+    return 1;
+  }
+
+  int started = 0;
+  for (; started < nthreads; started++)
+  {
+    if (worker_init(&workers[started]))
+    {
+      perror("worker");
+      worker_destroy(&workers[started]);
+      break;
+    }
+    if (pthread_create(&threads[started], NULL, server_worker,
+                       &workers[started]))
+    {
+      perror("pthread_create");
+      worker_destroy(&workers[started]);
+      break;
+    }
+  }
+
+  int sig = 0;
+  if (started == nthreads)
+  {
+    fprintf(stderr, "listening on %s with %d workers\n", path, nthreads);
+    sigwait(&sigs, &sig);
+  }
+
+  // Wake every worker, each finishes the connection it has first
+  if (write(server_wake[1], "", 1) != 1)
+    perror("wake");
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+    worker_destroy(&workers[i]);
+  }
+  while (server_conns)
+    conn_close(server_conns);
+  close(server_epoll);
+  close(server_wake[0]);
+  close(server_wake[1]);
+  close(server_fd);
+  free(workers);
+  free(threads);
+
+  unlink(path);
+  server_report(stderr);
+  return sig ? 0 : 1;
+}
+
+#endif
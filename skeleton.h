@@ -0,0 +1,159 @@
+#ifndef SKELETON_H
+#define SKELETON_H
+
+// Fast path for batch mode. Without tied notes every progression of the
+// same length encodes to the same bytes except for the keys of its notes:
+// headers, delta times, status bytes and chunk lengths never change. So
+// the file is encoded once, the offset of every key byte is recorded, and
+// each progression is a copy of that skeleton plus 8 key stores per chord.
+
+// From main.c
+int encode(midi_t *mid, Voicing *voicing, size_t n);
+
+// Key offsets of one chord, in the order play_chord writes them
+enum {
+  SK_BASE_ON,
+  SK_BASE_OFF,
+  SK_MAIN_ON,                  // One per voice
+  SK_MAIN_OFF = SK_MAIN_ON + 3,  // One per voice
+  SK_KEYS = SK_MAIN_OFF + 3,
+};
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t nchords;
+  uint32_t (*keys)[SK_KEYS];
+} Skeleton;
+
+// Offsets of the key bytes of the note events in the track chunk at `p`
+static size_t skeleton_scan_track(const uint8_t *data, size_t p, size_t end,
+                                  uint32_t *keys, size_t max)
+{
+  size_t n = 0;
+
+  while (p < end)
+  {
+    while (data[p++] & 0x80)
+      ;
+    uint8_t status = data[p];
+    if (status == 0xff)
+      break;
+
+    int kind = status >> 4;
+    if (kind == MIDI_MESSAGE_NOTE_ON_EVENT ||
+        kind == MIDI_MESSAGE_NOTE_OFF_EVENT)
+    {
+      if (n == max)
+        return max + 1;
+      keys[n++] = p + 1;
+    }
+    p += 3;
+  }
+
+  return n;
+}
+
+// Encode a progression of `n` chords once and record its key offsets,
+// returns 0 on success
+int skeleton_init(Skeleton *sk, size_t n)
+{
+  memset(sk, 0, sizeof (Skeleton));
+
+  ChordState *seq = calloc(n, sizeof (ChordState));
+  Voicing *voicing = calloc(n, sizeof (Voicing));
+  uint32_t *main_keys = malloc(sizeof (uint32_t) * 6 * n);
+  uint32_t *base_keys = malloc(sizeof (uint32_t) * 2 * n);
+  sk->keys = malloc(sizeof (*sk->keys) * n);
+  int err = seq == NULL || voicing == NULL || main_keys == NULL ||
+            base_keys == NULL || sk->keys == NULL;
+
+  midi_t mid = midi_create(MIDI_FORMAT_SIMULTANEOUS,
+                           midi_division_ticks_per_quarter_note(DIV));
+  for (size_t i = 0; !err && i < n; i++)
+    chst_init(&seq[i], PCLS_C, TAG_MAJOR);
+
+  if (!err)
+    voice_fixed(voicing, seq, n);
+
+  // Not a progression of the run, so it is not profiled
+  PROF_SUSPEND();
+  err = err || encode(&mid, voicing, n) || mid.ntrks != 2;
+  PROF_RESUME();
+  if (!err)
+  {
+    sk->size = midi_size(&mid);
+    sk->data = malloc(sk->size);
+    err = sk->data == NULL ||
+          midi_write_buffer(&mid, sk->data, sk->size, 1);
+  }
+
+  if (!err)
+  {
+    // Main track chunk first, then the base track
+    size_t main_at = 14 + 8;
+    size_t base_at = main_at + mid.tracks[0]->size + 8;
+    err = skeleton_scan_track(sk->data, main_at, base_at - 8, main_keys,
+                              6 * n) != 6 * n ||
+          skeleton_scan_track(sk->data, base_at, sk->size, base_keys,
+                              2 * n) != 2 * n;
+  }
+
+  for (size_t i = 0; !err && i < n; i++)
+  {
+    sk->keys[i][SK_BASE_ON] = base_keys[2 * i];
+    sk->keys[i][SK_BASE_OFF] = base_keys[2 * i + 1];
+    for (size_t v = 0; v < 3; v++)
+    {
+      sk->keys[i][SK_MAIN_ON + v] = main_keys[6 * i + v];
+      sk->keys[i][SK_MAIN_OFF + v] = main_keys[6 * i + 3 + v];
+    }
+  }
+  sk->nchords = n;
+
+  midi_destroy(&mid);
+  free(seq);
+  free(voicing);
+  free(main_keys);
+  free(base_keys);
+  if (err)
+  {
+    free(sk->data);
+    free(sk->keys);
+    memset(sk, 0, sizeof (Skeleton));
+    return -1;
+  }
+  return 0;
+}
+
+void skeleton_destroy(Skeleton *sk)
+{
+  free(sk->data);
+  free(sk->keys);
+  memset(sk, 0, sizeof (Skeleton));
+}
+
+// Write the file for `voicing` to `out`, which holds `sk->size` bytes
+void skeleton_patch(Skeleton *const sk, uint8_t *out, Voicing *const voicing)
+{
+  PROF_BEGIN(PROF_ENCODE);
+  memcpy(out, sk->data, sk->size);
+
+  for (size_t i = 0; i < sk->nchords; i++)
+  {
+    const uint32_t *keys = sk->keys[i];
+    const Voicing *vc = &voicing[i];
+
+    out[keys[SK_BASE_ON]] = out[keys[SK_BASE_OFF]] = vc->bass;
+    for (size_t v = 0; v < 3; v++)
+      out[keys[SK_MAIN_ON + v]] = out[keys[SK_MAIN_OFF + v]] = vc->upper[v];
+  }
+
+  PROF_COUNT(PROF_PROGRESSIONS, 1);
+  PROF_COUNT(PROF_TRACKS, 2);
+  PROF_COUNT(PROF_EVENTS, SK_KEYS * sk->nchords + 2);
+  PROF_COUNT(PROF_BYTES, sk->size - 14 - 2 * 8);  // Track data, as in encode
+  PROF_END(PROF_ENCODE);
+}
+
+#endif
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "definitions.h"
+#include "rules.h"
+#include "model.h"
+
+// Learns transition weights for `main -m` from a corpus of midi files.
+// Every file is mapped and scanned for moments where exactly three pitch
+// classes sound; those that form a chord `tag_intervals` knows become
+// the file's chord sequence, and each change is counted against the rule
+// in `rules` that moves the first chord onto the second.
+
+// A note on or off at an absolute tick, packed to sort by tick
+#define EVENT(tick, on, key) ((uint64_t) (tick) << 8 | (on) << 7 | (key))
+#define EVENT_TICK(e) ((e) >> 8)
+#define EVENT_ON(e)   (((e) >> 7) & 1)
+#define EVENT_KEY(e)  ((e) & 0x7f)
+
+// A recognized chord, `real_chord` in root position
+typedef struct {
+  HarmTag tag;
+  PitchClass real_chord[3];  // In the voice order the generator keeps
+  int ordered;               // Whether that order is known
+  uint16_t mask;
+} Triad;
+
+// Per thread counts, merged at the end. A change that more than one rule
+// explains is split evenly between them
+typedef struct {
+  double first[TAG_COUNT][MAX_RULES];
+  double second[TAG_COUNT][TAG_COUNT][MAX_RULES];
+  uint64_t files, bad_files, chords, transitions, unmatched, ambiguous;
+  uint64_t *events;
+  size_t nevents, cap;
+} Counts;
+
+char **paths;
+size_t npaths;
+atomic_size_t next_path;
+
+static inline int push_event(Counts *c, uint64_t event)
+{
+  if (c->nevents == c->cap)
+  {
+    size_t cap = c->cap ? c->cap * 2 : 4096;
+    uint64_t *events = realloc(c->events, sizeof (*events) * cap);
+    if (events == NULL)
+      return -1;
+    c->events = events;
+    c->cap = cap;
+  }
+  c->events[c->nevents++] = event;
+  return 0;
+}
+
+static inline int read_vlq(const uint8_t **p, const uint8_t *end, uint32_t *x)
+{
+  *x = 0;
+  for (size_t i = 0; i < 4; i++)
+  {
+    if (*p == end)
+      return -1;
+    uint8_t b = *(*p)++;
+    *x = (*x << 7) | (b & 0x7f);
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+static inline uint32_t read_u32_be(const uint8_t *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Collect the note events of one track chunk, drums excluded
+int scan_track(Counts *c, const uint8_t *p, const uint8_t *end)
+{
+  uint32_t tick = 0;
+  uint8_t status = 0;
+
+  while (p < end)
+  {
+    uint32_t dt, len;
+    if (read_vlq(&p, end, &dt) || p == end)
+      return -1;
+    tick += dt;
+
+    if (*p & 0x80)
+      status = *p++;
+    else if (status == 0)
+      return -1;
+
+    if (status == 0xff)
+    {
+      if (p == end)
+        return -1;
+      uint8_t type = *p++;
+      if (read_vlq(&p, end, &len) || len > (size_t) (end - p))
+        return -1;
+      p += len;
+      if (type == 0x2f)
+        break;
+      status = 0;
+      continue;
+    }
+
+    if (status == 0xf0 || status == 0xf7)
+    {
+      if (read_vlq(&p, end, &len) || len > (size_t) (end - p))
+        return -1;
+      p += len;
+      status = 0;
+      continue;
+    }
+
+    int kind = status >> 4;
+    size_t ndata = kind == 0xc || kind == 0xd ? 1 : 2;
+    if ((size_t) (end - p) < ndata)
+      return -1;
+
+    if ((kind == 8 || kind == 9) && (status & 0xf) != 9)
+    {
+      int on = kind == 9 && p[1] > 0;
+      if (push_event(c, EVENT(tick, on, p[0] & 0x7f)))
+        return -1;
+    }
+    p += ndata;
+  }
+
+  return 0;
+}
+
+int compare_events(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Recognize the pitch class set `mask` as a chord
+int classify(uint16_t mask, Triad *t)
+{
+  for (PitchClass root = 0; root < 12; root++)
+  {
+    if (!(mask & 1 << root))
+      continue;
+    for (int tag = 0; tag < TAG_COUNT; tag++)
+    {
+      uint16_t m = 0;
+      for (size_t i = 0; i < 3; i++)
+        m |= 1 << (root + tag_intervals[tag][i]) % 12;
+      if (m == mask)
+      {
+        t->tag = tag;
+        t->ordered = 0;
+        t->mask = mask;
+        for (size_t i = 0; i < 3; i++)
+          t->real_chord[i] = (root + tag_intervals[tag][i]) % 12;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+// Rules out of `from` that lead to the pitch class set `to`, as a bit
+// mask. The rules move voices, so the voice order of `from` picks the
+// rule; where it is not known, any note of an augmented chord may be its
+// root, so try them all. If the matches agree on the voice order they
+// leave `to` in, it is stored in `to_chord` and `*ordered` is set
+uint16_t match_rules(const Triad *from, uint16_t to, PitchClass *to_chord,
+                     int *ordered)
+{
+  const RuleSet *set = &rules[from->tag];
+  size_t rotations = from->tag == TAG_AUGMENTED && !from->ordered ? 3 : 1;
+  uint16_t matches = 0;
+  int orders = 0;
+
+  for (size_t r = 0; r < rotations; r++)
+  {
+    for (size_t c = 0; c < set->count; c++)
+    {
+      PitchClass next[3];
+      uint16_t m = 0;
+      for (size_t i = 0; i < 3; i++)
+      {
+        next[i] = PCLS_WRAP(from->real_chord[(i + r) % 3] +
+                            set->rules[c].delta[i]);
+        m |= 1 << next[i];
+      }
+      if (m != to)
+        continue;
+
+      matches |= 1 << c;
+      if (orders == 0 || memcmp(next, to_chord, sizeof (next)))
+        orders++;
+      memcpy(to_chord, next, sizeof (next));
+    }
+  }
+
+  *ordered = orders == 1;
+  return matches;
+}
+
+// Count the chord changes of the events collected from one file
+void count_changes(Counts *c)
+{
+  qsort(c->events, c->nevents, sizeof (uint64_t), compare_events);
+
+  uint16_t sounding[128] = { 0 };
+  uint16_t classes[12] = { 0 };
+  Triad prev, curr;
+  int have_prev = 0;
+  int prev_tag = -1;
+
+  for (size_t i = 0; i < c->nevents;)
+  {
+    // Apply every event at this tick, then look at what sounds
+    uint64_t tick = EVENT_TICK(c->events[i]);
+    for (; i < c->nevents && EVENT_TICK(c->events[i]) == tick; i++)
+    {
+      int key = EVENT_KEY(c->events[i]);
+      if (EVENT_ON(c->events[i]))
+      {
+        if (sounding[key]++ == 0)
+          classes[key % 12]++;
+      }
+      else if (sounding[key] && --sounding[key] == 0)
+        classes[key % 12]--;
+    }
+
+    uint16_t mask = 0;
+    for (size_t k = 0; k < 12; k++)
+      if (classes[k])
+        mask |= 1 << k;
+
+    if (__builtin_popcount(mask) != 3 || (have_prev && mask == prev.mask) ||
+        classify(mask, &curr))
+      continue;
+
+    c->chords++;
+    if (have_prev)
+    {
+      c->transitions++;
+      PitchClass order[3];
+      int ordered;
+      uint16_t matches = match_rules(&prev, mask, order, &ordered);
+      int k = __builtin_popcount(matches);
+      if (k == 0)
+        c->unmatched++;
+      if (k > 1)
+        c->ambiguous++;
+      for (size_t rule = 0; rule < MAX_RULES; rule++)
+      {
+        if (!(matches & 1 << rule))
+          continue;
+        c->first[prev.tag][rule] += 1.0 / k;
+        if (prev_tag >= 0)
+          c->second[prev_tag][prev.tag][rule] += 1.0 / k;
+      }
+      prev_tag = matches ? (int) prev.tag : -1;
+
+      // Follow the voices into the new chord, as the generator does
+      if (ordered)
+      {
+        memcpy(curr.real_chord, order, sizeof (order));
+        curr.ordered = 1;
+      }
+    }
+    prev = curr;
+    have_prev = 1;
+  }
+}
+
+int scan_file(Counts *c, const uint8_t *data, size_t size)
+{
+  if (size < 14 || memcmp(data, "MThd", 4))
+    return -1;
+
+  uint32_t hdr = read_u32_be(data + 4);
+  if (hdr > size - 8)
+    return -1;
+
+  c->nevents = 0;
+  const uint8_t *p = data + 8 + hdr;
+  const uint8_t *end = data + size;
+
+  while (end - p >= 8)
+  {
+    uint32_t len = read_u32_be(p + 4);
+    if (len > (size_t) (end - p) - 8)
+      return -1;
+    if (memcmp(p, "MTrk", 4) == 0 && scan_track(c, p + 8, p + 8 + len))
+      return -1;
+    p += 8 + len;
+  }
+
+  count_changes(c);
+  return 0;
+}
+
+void *train_worker(void *arg)
+{
+  Counts *c = arg;
+
+  for (;;)
+  {
+    size_t i = atomic_fetch_add(&next_path, 1);
+    if (i >= npaths)
+      break;
+
+    int fd = open(paths[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || st.st_size == 0)
+    {
+      if (fd >= 0)
+        close(fd);
+      c->bad_files++;
+      continue;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+      c->bad_files++;
+      continue;
+    }
+
+    if (scan_file(c, data, st.st_size))
+      c->bad_files++;
+    else
+      c->files++;
+    munmap(data, st.st_size);
+  }
+
+  return NULL;
+}
+
+static inline uint32_t saturate(double x)
+{
+  return x >= UINT32_MAX ? UINT32_MAX : (uint32_t) (x + 0.5);
+}
+
+// Read one path per line from `f`
+int read_paths(FILE *f)
+{
+  char *line = NULL;
+  size_t cap = 0, paths_cap = 0;
+  ssize_t n;
+
+  while ((n = getline(&line, &cap, f)) > 0)
+  {
+    if (line[n - 1] == '\n')
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+    if (npaths == paths_cap)
+    {
+      paths_cap = paths_cap ? paths_cap * 2 : 1024;
+      char **p = realloc(paths, sizeof (*paths) * paths_cap);
+      if (p == NULL)
+        return -1;
+      paths = p;
+    }
+    if ((paths[npaths++] = strdup(line)) == NULL)
+      return -1;
+  }
+
+  free(line);
+  return 0;
+}
+
+void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s -o MODEL [-j THREADS] FILE...\n"
+          "       %s -o MODEL [-j THREADS] -     read the file list from stdin\n",
+          prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *out = NULL;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:j:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'o': out = optarg; break;
+      case 'j': nthreads = atol(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (out == NULL || optind == argc || nthreads < 1)
+    usage(argv[0]);
+
+  if (argc - optind == 1 && strcmp(argv[optind], "-") == 0)
+  {
+    if (read_paths(stdin))
+    {
+      perror("stdin");
+      return 1;
+    }
+  }
+  else
+  {
+    paths = &argv[optind];
+    npaths = argc - optind;
+  }
+
+  Counts *counts = calloc(nthreads, sizeof (Counts));
+  pthread_t *threads = malloc(sizeof (*threads) * nthreads);
+  if (counts == NULL || threads == NULL)
+  {
+    perror("train");
+    return 1;
+  }
+
+  long started = 0;
+  while (started < nthreads &&
+         !pthread_create(&threads[started], NULL, train_worker,
+                         &counts[started]))
+    started++;
+  if (started == 0)
+    train_worker(&counts[0]);
+  for (long i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  // Merge the per thread tables, counts[0] alone when run inline
+  Counts total = { 0 };
+  for (long t = 0; t < (started ? started : 1); t++)
+  {
+    Counts *c = &counts[t];
+    for (size_t i = 0; i < TAG_COUNT; i++)
+      for (size_t r = 0; r < MAX_RULES; r++)
+      {
+        total.first[i][r] += c->first[i][r];
+        for (size_t j = 0; j < TAG_COUNT; j++)
+          total.second[j][i][r] += c->second[j][i][r];
+      }
+    total.files += c->files;
+    total.bad_files += c->bad_files;
+    total.chords += c->chords;
+    total.transitions += c->transitions;
+    total.unmatched += c->unmatched;
+    total.ambiguous += c->ambiguous;
+    free(c->events);
+  }
+  free(counts);
+
+  Model model;
+  for (size_t i = 0; i < TAG_COUNT; i++)
+    for (size_t r = 0; r < MAX_RULES; r++)
+    {
+      model.first[i][r] = saturate(total.first[i][r]);
+      for (size_t j = 0; j < TAG_COUNT; j++)
+        model.second[j][i][r] = saturate(total.second[j][i][r]);
+    }
+
+  fprintf(stderr, "%llu files (%llu unreadable), %llu chords, "
+          "%llu changes, %llu matched no rule, %llu more than one\n",
+          (unsigned long long) total.files,
+          (unsigned long long) total.bad_files,
+          (unsigned long long) total.chords,
+          (unsigned long long) total.transitions,
+          (unsigned long long) total.unmatched,
+          (unsigned long long) total.ambiguous);
+
+  if (model_save(&model, out))
+  {
+    perror(out);
+    return 1;
+  }
+}
@@ -0,0 +1,193 @@
+#ifndef VOICING_H
+#define VOICING_H
+
+// Concrete keys for the chords of a progression. By default every voice
+// sits in its own fixed octave, `oct` and `base_oct`; with -v the keys of
+// the whole progression are chosen together to move the voices as little
+// as possible.
+
+// Keys of one chord, the bass and the three voices of the main track
+typedef struct {
+  uint8_t bass;
+  uint8_t upper[3];
+} Voicing;
+
+// Choose keys with voice_optimal rather than voice_fixed
+int optimize_voicing = 0;
+
+// Ranges and largest gap between neighbouring upper voices for
+// voice_optimal
+#define BASS_LO   33
+#define BASS_HI   47
+#define UPPER_LO  48
+#define UPPER_HI  84
+#define SPACING   12
+#define UPPER_MID 66
+
+// At most 6 orders of the pitch classes times 3 octaves for the lowest
+#define MAX_CANDIDATES 18
+
+// Bytes of scratch voice_optimal needs for `n` chords
+#define VOICE_SCRATCH(n) ((n) * MAX_CANDIDATES)
+
+void voice_fixed(Voicing *out, ChordState *const seq, size_t n)
+{
+  for (size_t j = 0; j < n; j++)
+  {
+    out[j].bass = PITCH(base_oct, seq[j].chord[0]);
+    for (size_t i = 0; i < 3; i++)
+      out[j].upper[i] = PITCH(oct[i], seq[j].chord[i]);
+  }
+}
+
+// Every way to lay out the upper voices of `chd` low to high inside the
+// range with no gap above SPACING: each order of the pitch classes, from
+// each octave of the lowest one. Returns the count
+size_t upper_candidates(ChordState *const chd, Voicing *cands)
+{
+  size_t n = 0;
+
+  for (int perm = 0; perm < PERM_COUNT; perm++)
+  {
+    PitchClass pc[3];
+    permute(pc, chd->real_chord, perm);
+
+    for (int low = UPPER_LO + PCLS_WRAP(pc[0] - UPPER_LO % 12);
+         low <= UPPER_HI; low += 12)
+    {
+      int mid = low + (PCLS_WRAP(pc[1] - pc[0]) ? PCLS_WRAP(pc[1] - pc[0]) : 12);
+      int high = mid + (PCLS_WRAP(pc[2] - pc[1]) ? PCLS_WRAP(pc[2] - pc[1]) : 12);
+      if (mid - low > SPACING || high - mid > SPACING || high > UPPER_HI)
+        continue;
+
+      cands[n].bass = 0;
+      cands[n].upper[0] = low;
+      cands[n].upper[1] = mid;
+      cands[n].upper[2] = high;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+// Keys of the root inside the bass range, returns the count
+size_t bass_candidates(ChordState *const chd, int *keys)
+{
+  int key = BASS_LO + PCLS_WRAP(chd->real_chord[0] - BASS_LO % 12);
+  keys[0] = key;
+  keys[1] = key + 12;
+  return key + 12 <= BASS_HI ? 2 : 1;
+}
+
+static inline int upper_distance(const Voicing *a, const Voicing *b)
+{
+  int d = 0;
+  for (size_t i = 0; i < 3; i++)
+    d += ABS(a->upper[i] - b->upper[i]);
+  return d;
+}
+
+// Choose keys for all `n` chords of `seq`, with the bass on the root,
+// minimizing the total distance all voices move. Viterbi over the
+// candidates of each chord, O(n * MAX_CANDIDATES^2); `from` holds
+// VOICE_SCRATCH(n) bytes of back pointers
+void voice_optimal(Voicing *out, ChordState *const seq, size_t n,
+                   uint8_t *from)
+{
+  if (n == 0)
+    return;
+
+  Voicing prev[MAX_CANDIDATES], curr[MAX_CANDIDATES];
+  int prev_cost[MAX_CANDIDATES], curr_cost[MAX_CANDIDATES];
+
+  // Start near the middle of the range
+  size_t nprev = upper_candidates(&seq[0], prev);
+  for (size_t c = 0; c < nprev; c++)
+    prev_cost[c] = ABS(prev[c].upper[1] - UPPER_MID);
+
+  for (size_t j = 1; j < n; j++)
+  {
+    size_t ncurr = upper_candidates(&seq[j], curr);
+    for (size_t c = 0; c < ncurr; c++)
+    {
+      int best = INT_MAX;
+      for (size_t p = 0; p < nprev; p++)
+      {
+        int cost = prev_cost[p] + upper_distance(&prev[p], &curr[c]);
+        if (cost < best)
+        {
+          best = cost;
+          from[j * MAX_CANDIDATES + c] = p;
+        }
+      }
+      curr_cost[c] = best;
+    }
+    memcpy(prev, curr, sizeof (Voicing) * ncurr);
+    memcpy(prev_cost, curr_cost, sizeof (int) * ncurr);
+    nprev = ncurr;
+  }
+
+  // Walk back from the cheapest last voicing
+  size_t c = 0;
+  for (size_t p = 1; p < nprev; p++)
+    if (prev_cost[p] < prev_cost[c])
+      c = p;
+
+  for (size_t j = n; j-- > 0;)
+  {
+    Voicing cands[MAX_CANDIDATES];
+    upper_candidates(&seq[j], cands);
+    out[j] = cands[c];
+    c = from[j * MAX_CANDIDATES + c];
+  }
+
+  // The bass moves independently of the upper voices, so the same walk
+  // over its at most 2 keys per chord, reusing `from`
+  int bprev[2], bcost[2], bcurr[2], bnext[2];
+  size_t nb = bass_candidates(&seq[0], bprev);
+  for (size_t b = 0; b < nb; b++)
+    bcost[b] = ABS(bprev[b] - (BASS_LO + BASS_HI) / 2);
+
+  for (size_t j = 1; j < n; j++)
+  {
+    size_t ncurr = bass_candidates(&seq[j], bcurr);
+    for (size_t b = 0; b < ncurr; b++)
+    {
+      int best = INT_MAX;
+      for (size_t p = 0; p < nb; p++)
+      {
+        int cost = bcost[p] + ABS(bprev[p] - bcurr[b]);
+        if (cost < best)
+        {
+          best = cost;
+          from[2 * j + b] = p;
+        }
+      }
+      bnext[b] = best;
+    }
+    memcpy(bprev, bcurr, sizeof (bcurr));
+    memcpy(bcost, bnext, sizeof (bnext));
+    nb = ncurr;
+  }
+
+  c = nb > 1 && bcost[1] < bcost[0];
+  for (size_t j = n; j-- > 0;)
+  {
+    int keys[2];
+    bass_candidates(&seq[j], keys);
+    out[j].bass = keys[c];
+    c = from[2 * j + c];
+  }
+}
+
+// Keys for `seq` as selected by -v, `from` as for voice_optimal
+void voice(Voicing *out, ChordState *const seq, size_t n, uint8_t *from)
+{
+  if (optimize_voicing)
+    voice_optimal(out, seq, n, from);
+  else
+    voice_fixed(out, seq, n);
+}
+
+#endif